@@ -0,0 +1,116 @@
+/*
+ * bench.c
+ *
+ * load generator for server.c.
+ * - keeps `depth` requests in flight on one connection.
+ * - mix: 60% find, 20% insert, 10% update, 10% erase on random keys.
+ * - the value of a key is `value size` copies of one byte derived from
+ *   the key, and every found value is checked against it. exits 1 on a
+ *   wrong value or a lost connection.
+ *
+ * usage: bench [addr] [ops] [depth] [value size] [keys]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "client.h"
+#include "protocol.h"
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char fill_of(uint64_t key) {
+  return 'a' + key % 26;
+}
+
+/*
+ * send a random request
+ * return its op, and its key in `*key`
+ */
+static uint8_t send_random(client_t* client, char* value, uint32_t size, uint64_t keys, uint64_t* key) {
+  uint8_t op;
+  *key = rand() % keys;
+  int r = rand() % 10;
+  if (r < 6)
+    op = OP_FIND;
+  else if (r < 8)
+    op = OP_INSERT;
+  else if (r < 9)
+    op = OP_UPDATE;
+  else
+    op = OP_ERASE;
+  if (op == OP_INSERT || op == OP_UPDATE) {
+    memset(value, fill_of(*key), size);
+    client_send(client, op, *key, value, size);
+  }
+  else
+    client_send(client, op, *key, NULL, 0);
+  return op;
+}
+
+static int check_value(const char* body, uint32_t n, uint32_t size, uint64_t key) {
+  if (n != size)
+    return 0;
+  for (uint32_t i = 0; i < n; i++)
+    if (body[i] != fill_of(key))
+      return 0;
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  const char* addr = argc > 1 ? argv[1] : "db.sock";
+  uint64_t ops = argc > 2 ? strtoull(argv[2], NULL, 10) : 100000;
+  uint64_t depth = argc > 3 ? strtoull(argv[3], NULL, 10) : 64;
+  uint32_t size = argc > 4 ? strtoul(argv[4], NULL, 10) : 100;
+  uint64_t keys = argc > 5 ? strtoull(argv[5], NULL, 10) : 10000;
+  if (depth == 0)
+    depth = 1;
+
+  client_t* client = client_open(addr);
+  if (client == NULL) {
+    perror(addr);
+    return 1;
+  }
+  char* value = malloc(size);
+  uint8_t* flight_ops = malloc(depth * sizeof(uint8_t)); // requests in flight, by sequence % depth
+  uint64_t* flight_keys = malloc(depth * sizeof(uint64_t));
+
+  uint64_t sent = 0, done = 0, ok = 0;
+  double start = now();
+  while (done < ops) {
+    if (sent - done <= depth / 2) { // refill the window in one batch
+      while (sent < ops && sent - done < depth) {
+        flight_ops[sent % depth] = send_random(client, value, size, keys, &flight_keys[sent % depth]);
+        sent++;
+      }
+    }
+    const char* body;
+    uint32_t n;
+    int status = client_recv(client, &body, &n);
+    if (status < 0) {
+      fprintf(stderr, "connection lost after %lu responses\n", (unsigned long)done);
+      return 1;
+    }
+    uint64_t key = flight_keys[done % depth];
+    if (flight_ops[done % depth] == OP_FIND && status == STATUS_OK && !check_value(body, n, size, key)) {
+      fprintf(stderr, "wrong value of key %lu\n", (unsigned long)key);
+      return 1;
+    }
+    ok += status == STATUS_OK;
+    done++;
+  }
+  double elapsed = now() - start;
+
+  printf("ops: %lu, ok: %lu, depth: %lu, time: %.3fs, throughput: %.0f ops/s\n",
+         (unsigned long)ops, (unsigned long)ok, (unsigned long)depth, elapsed, ops / elapsed);
+  client_close(client);
+  free(value);
+  free(flight_ops);
+  free(flight_keys);
+  return 0;
+}
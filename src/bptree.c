@@ -7,19 +7,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 
 #include "bptree.h"
+#include "cache.h"
+#include "file.h"
+#include "log.h"
 
-#define ORDER 254
+#define ORDER 168
 #define NODE_SIZE (sizeof(bpnode) + sizeof(header_t))
 #define MAGIC 0x1234567
 #define BRANCH 0x01
 #define LEAF 0x02
+#define BUCKET 0x03
+#define DIRECTORY 0x04
 #define HEAD 0x00
 #define MIN_BLOCK_SIZE 32
 #define NULL_OFF 0x00
 #define OK 1
 #define ERR 0
+#define NULL_SEG 0x00
+#define EXTENT (1ull << 63)
+#define MAX_EXTENTS 64
+#define MIN_EXTENT_SIZE (4 << 10)
+#define MAX_EXTENT_SIZE (64 << 20)
+#define STREAM_CHUNK (64 << 10)
+#define HASH_LOAD 75 // split a bucket when keys fill this percent of buckets
+#define GC_STEP 8
+#define FORMAT 0x6270747265650001 // "bptree" and the version of the file format
 
 static char* idx_fn;
 static char* dat_fn;
@@ -27,11 +45,30 @@ static char* dat_fn;
 static FILE* idx_fp;
 static FILE* dat_fp;
 
+static int min_fill = ORDER / 2; // a child this small is fixed before erase descends
+
+static int store = STORE_FREE_LIST;
+static int index_type = INDEX_BPTREE;
+static int gc_threshold = 50; // collect a segment when live bytes drop below this percent
+static uint64_t gc_seg = NULL_SEG;
+static uint64_t gc_pos;
+
+static uint64_t* dir; // offsets of buckets of hash index
+static uint64_t dir_cap;
+static uint64_t* dir_pages; // offsets of directory pages
+static uint64_t dir_pages_count;
+
 static struct {
+  uint64_t format;
   uint64_t head;
   uint64_t root;
   uint64_t height;
   uint64_t size;
+  uint64_t store;
+  uint64_t index;
+  uint64_t level; // hash index only
+  uint64_t split; // hash index only
+  uint64_t keys;  // hash index only
 } idx_header;
 
 static struct {
@@ -44,12 +81,22 @@ typedef struct {
   uint64_t next;
 } header_t;
 
+typedef struct {
+  uint64_t size; // EXTENT | length of data
+  uint64_t count;
+  struct {
+    uint64_t offset;
+    uint64_t size;
+  } extents[MAX_EXTENTS];
+} extent_head;
+
 typedef struct {
   uint8_t type;
   uint8_t size;
   uint8_t reserved[6];
   uint64_t keys[ORDER];
   uint64_t children[ORDER];
+  uint64_t counts[ORDER];
   uint64_t next;
 } bpnode;
 
@@ -57,27 +104,81 @@ size_t Fread(void* ptr, size_t size, size_t nmemb, FILE* stream) {
   return fread(ptr, size, nmemb, stream);
 }
 
+/*
+ * number of keys stored in the subtree of a node
+ */
+static uint64_t node_count(const bpnode* node) {
+  if (node->type == LEAF)
+    return node->size;
+  uint64_t count = 0;
+  for (int i = 0; i < node->size; i++)
+    count += node->counts[i];
+  return count;
+}
+
+/*
+ * choose the value store of files created by `init()`
+ * - STORE_FREE_LIST writes values in place into `.dat`.
+ * - STORE_LOG appends values to segment files, see log.c.
+ * - files which already exist keep their own store.
+ */
+void set_store(int s) {
+  store = s;
+}
+
+static void hash_create();
+
+static void hash_open();
+
+/*
+ * choose the index of files created by `init()`
+ * - INDEX_BPTREE keeps keys in order, see the B+ tree below.
+ * - INDEX_HASH only supports lookup by exact key, see the hash index below.
+ * - files which already exist keep their own index.
+ */
+void set_index(int type) {
+  index_type = type;
+}
+
 /*
  * do initialization of bptree.
  * - if file exist, open the file and read the header.
  * - if not, create the file, initialize the header and the free list.
+ * - the index file stays locked until `destroy()`, so only one process
+ *   opens a database at a time.
+ * return ERR if another process holds the database, or the file was
+ * written by another version, and leave it alone
  */
-void init(const char* fn) {
+int init(const char* fn) {
   int len = strlen(fn);
 
   idx_fn = malloc(len + 5);
   strcpy(idx_fn, fn);
   strcpy(idx_fn + len, ".idx");
-  idx_fp = fopen(idx_fn, "rb+");
+  int fd = open(idx_fn, O_RDWR | O_CREAT, 0644);
+  struct stat st;
+  if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    free(idx_fn);
+    idx_fn = NULL;
+    return ERR;
+  }
+  idx_fp = fdopen(fd, "rb+");
 
-  if (idx_fp == NULL) {
-    idx_fp = fopen(idx_fn, "wb+");
+  if (st.st_size == 0) {
 
     // write header
+    idx_header.format = FORMAT;
     idx_header.head = sizeof(idx_header);
     idx_header.root = 0;
     idx_header.height = 0;
     idx_header.size = 0;
+    idx_header.store = store;
+    idx_header.index = index_type;
+    idx_header.level = 0;
+    idx_header.split = 0;
+    idx_header.keys = 0;
     fwrite(&idx_header, sizeof(idx_header), 1, idx_fp);
 
     // write head node
@@ -85,9 +186,27 @@ void init(const char* fn) {
     header.size = UINT64_MAX;
     header.next = 0;
     fwrite(&header, sizeof(header), 1, idx_fp);
+
+    if (index_type == INDEX_HASH)
+      hash_create();
   }
   else {
-    Fread(&idx_header, sizeof(idx_header), 1, idx_fp);
+    if (Fread(&idx_header, sizeof(idx_header), 1, idx_fp) != 1 || idx_header.format != FORMAT) {
+      fclose(idx_fp);
+      idx_fp = NULL;
+      free(idx_fn);
+      idx_fn = NULL;
+      return ERR;
+    }
+    store = idx_header.store;
+    index_type = idx_header.index;
+    if (index_type == INDEX_HASH)
+      hash_open();
+  }
+
+  if (store == STORE_LOG) {
+    log_init(fn);
+    return OK;
   }
 
   dat_fn = malloc(len + 5);
@@ -112,32 +231,30 @@ void init(const char* fn) {
   else {
     Fread(&dat_header, sizeof(dat_header), 1, dat_fp);
   }
+  return OK;
 }
 
 /*
  * update idx_header to file
  */
 static void update_idx_header() {
-  fseek(idx_fp, HEAD, SEEK_SET);
-  fwrite(&idx_header, sizeof(idx_header), 1, idx_fp);
-  fflush(idx_fp);
+  file_write(idx_fp, HEAD, &idx_header, sizeof(idx_header));
+  file_flush(idx_fp);
 }
 
 /*
  * read one node
  */
 static void read_node(bpnode* node, uint64_t offset) {
-  fseek(idx_fp, offset, SEEK_SET);
-  Fread(node, sizeof(*node), 1, idx_fp);
+  file_read(idx_fp, offset, node, sizeof(*node));
 }
 
 /*
  * write one node
  */
 static void update_node(const bpnode* node, uint64_t offset) {
-  fseek(idx_fp, offset, SEEK_SET);
-  fwrite(node, sizeof(*node), 1, idx_fp);
-  fflush(idx_fp);
+  file_write(idx_fp, offset, node, sizeof(*node));
+  file_flush(idx_fp);
 }
 
 /*
@@ -148,24 +265,20 @@ static uint64_t alloc_node(const bpnode* node) {
   uint64_t offset = idx_header.head + sizeof(header_t); // return ptr to allocated space
 
   header_t header;
-  fseek(idx_fp, idx_header.head, SEEK_SET);
-  Fread(&header, sizeof(header), 1, idx_fp);
+  file_read(idx_fp, idx_header.head, &header, sizeof(header));
 
   if (header.size == sizeof(bpnode)) { // allocate the hole block
     uint64_t magic = MAGIC;
-    fseek(idx_fp, idx_header.head + sizeof(header.size), SEEK_SET);
-    fwrite(&magic, sizeof(magic), 1, idx_fp);
+    file_write(idx_fp, idx_header.head + sizeof(header.size), &magic, sizeof(magic));
 
     idx_header.head = header.next;
   }
   else { // split
-    fseek(idx_fp, idx_header.head + NODE_SIZE, SEEK_SET);
-    fwrite(&header, sizeof(header), 1, idx_fp);
+    file_write(idx_fp, idx_header.head + NODE_SIZE, &header, sizeof(header));
 
     header.size = sizeof(bpnode);
     header.next = MAGIC;
-    fseek(idx_fp, idx_header.head, SEEK_SET);
-    fwrite(&header, sizeof(header), 1, idx_fp);
+    file_write(idx_fp, idx_header.head, &header, sizeof(header));
 
     idx_header.head += NODE_SIZE;
   }
@@ -186,20 +299,71 @@ static void free_node(uint64_t offset) {
   header_t header;
 
   offset -= sizeof(header_t);
-  fseek(idx_fp, offset, SEEK_SET);
-  Fread(&header, sizeof(header), 1, idx_fp);
+  file_read(idx_fp, offset, &header, sizeof(header));
 
   assert(header.next == MAGIC);
 
   header.next = idx_header.head;
-  fseek(idx_fp, offset, SEEK_SET);
-  fwrite(&header, sizeof(header), 1, idx_fp);
+  file_write(idx_fp, offset, &header, sizeof(header));
 
   idx_header.head = offset;
   idx_header.size--;
   update_idx_header();
 }
 
+/*
+ * read the head of an extent data
+ */
+static void read_head(extent_head* head, uint64_t offset) {
+  file_read(dat_fp, offset, head, sizeof(*head));
+}
+
+/*
+ * write the head of an extent data
+ */
+static void update_head(const extent_head* head, uint64_t offset) {
+  file_write(dat_fp, offset, head, sizeof(*head));
+  file_flush(dat_fp);
+}
+
+/*
+ * read `len` bytes from `pos` of an extent data
+ */
+static void read_extents(const extent_head* head, uint64_t pos, char* buf, uint64_t len) {
+  for (uint64_t i = 0; i < head->count && len > 0; i++) {
+    uint64_t elen = head->extents[i].size;
+    if (pos >= elen) {
+      pos -= elen;
+      continue;
+    }
+    uint64_t n = elen - pos < len ? elen - pos : len;
+    file_read(dat_fp, head->extents[i].offset + pos, buf, n);
+    buf += n;
+    len -= n;
+    pos = 0;
+  }
+}
+
+/*
+ * write `len` bytes to `pos` of an extent data
+ * - extents must already cover `pos + len`.
+ */
+static void write_extents(const extent_head* head, uint64_t pos, const char* buf, uint64_t len) {
+  for (uint64_t i = 0; i < head->count && len > 0; i++) {
+    uint64_t elen = head->extents[i].size;
+    if (pos >= elen) {
+      pos -= elen;
+      continue;
+    }
+    uint64_t n = elen - pos < len ? elen - pos : len;
+    file_write(dat_fp, head->extents[i].offset + pos, buf, n);
+    buf += n;
+    len -= n;
+    pos = 0;
+  }
+  file_flush(dat_fp);
+}
+
 /*
  * read one data
  *
@@ -208,23 +372,33 @@ static void free_node(uint64_t offset) {
  * - free(data);
  */
 static data_t* read_data(uint64_t offset) {
-  fseek(dat_fp, offset, SEEK_SET);
+  if (store == STORE_LOG)
+    return log_read(offset);
 
   data_t* data = malloc(sizeof(data_t));
-  Fread(&data->size, sizeof(data->size), 1, dat_fp);
+  file_read(dat_fp, offset, &data->size, sizeof(data->size));
+
+  if (data->size & EXTENT) {
+    extent_head head;
+    read_head(&head, offset);
+    data->size = head.size & ~EXTENT;
+    data->data = malloc(data->size * sizeof(char));
+    read_extents(&head, 0, data->data, data->size);
+    return data;
+  }
 
   data->data = malloc(data->size * sizeof(char));
-  Fread(data->data, sizeof(*data->data), data->size, dat_fp);
+  file_read(dat_fp, offset + sizeof(data->size), data->data, data->size);
 
   return data;
 }
 
 /*
- * allocate a space for a data and write it
- * return the offset of the new data
+ * allocate a block of at least `size` bytes in data file
+ * return the offset of the new block
  */
-uint64_t alloc_data(const char* data, uint64_t size) {
-  uint64_t size_tmp = size + sizeof(uint64_t);
+static uint64_t alloc_block(uint64_t size) {
+  uint64_t size_tmp = size;
   size_tmp = (((size_tmp >> 4) + ((size_tmp & 0xf) != 0)) << 4); // ((size_tmp + 15) // 16) * 16
 
   header_t header;
@@ -235,12 +409,10 @@ uint64_t alloc_data(const char* data, uint64_t size) {
   uint64_t pbest = NULL_OFF;
   uint64_t ppbest = NULL_OFF;
 
-  fseek(dat_fp, pp, SEEK_SET);
-  Fread(&p, sizeof(p), 1, dat_fp);
+  file_read(dat_fp, pp, &p, sizeof(p));
 
   while (p != NULL_OFF) {
-    fseek(dat_fp, p, SEEK_SET);
-    Fread(&header, sizeof(header), 1, dat_fp);
+    file_read(dat_fp, p, &header, sizeof(header));
 
     if (header.size >= size_tmp && (pbest == NULL_OFF || (header.size < best))) {
       best = header.size;
@@ -255,42 +427,29 @@ uint64_t alloc_data(const char* data, uint64_t size) {
   if (pbest != NULL_OFF) {
     uint64_t offset = pbest + sizeof(header_t); // return ptr to allocated space
 
-    fseek(dat_fp, pbest, SEEK_SET);
-    Fread(&header, sizeof(header), 1, dat_fp);
+    file_read(dat_fp, pbest, &header, sizeof(header));
 
     if (header.size - size_tmp < MIN_BLOCK_SIZE) { // allocate the hole block
       uint64_t magic = MAGIC;
-      fseek(dat_fp, pbest + sizeof(header.size), SEEK_SET);
-      fwrite(&magic, sizeof(magic), 1, dat_fp);
+      file_write(dat_fp, pbest + sizeof(header.size), &magic, sizeof(magic));
 
-      fseek(dat_fp, ppbest, SEEK_SET);
-      fwrite(&header.next, sizeof(header.next), 1, dat_fp);
+      file_write(dat_fp, ppbest, &header.next, sizeof(header.next));
     }
     else { // split
       header.size -= (sizeof(header_t) + size_tmp);
-      fseek(dat_fp, pbest + sizeof(header_t) + size_tmp, SEEK_SET);
-      fwrite(&header, sizeof(header), 1, dat_fp);
+      file_write(dat_fp, pbest + sizeof(header_t) + size_tmp, &header, sizeof(header));
 
       header.size = size_tmp;
       header.next = MAGIC;
-      fseek(dat_fp, pbest, SEEK_SET);
-      fwrite(&header, sizeof(header), 1, dat_fp);
+      file_write(dat_fp, pbest, &header, sizeof(header));
       
       pbest += (sizeof(header_t) + size_tmp);
-      fseek(dat_fp, ppbest, SEEK_SET);
-      fwrite(&pbest, sizeof(pbest), 1, dat_fp);
+      file_write(dat_fp, ppbest, &pbest, sizeof(pbest));
     }
 
-    fseek(dat_fp, HEAD, SEEK_SET);
-    Fread(&dat_header, sizeof(dat_header), 1, dat_fp);
+    file_read(dat_fp, HEAD, &dat_header, sizeof(dat_header));
     dat_header.size++;
-    fseek(dat_fp, HEAD, SEEK_SET);
-    fwrite(&dat_header, sizeof(dat_header), 1, dat_fp);
-
-    fseek(dat_fp, offset, SEEK_SET);
-    fwrite(&size, sizeof(size), 1, dat_fp);
-    fwrite(data, sizeof(*data), size, dat_fp);
-    fflush(dat_fp);
+    file_write(dat_fp, HEAD, &dat_header, sizeof(dat_header));
     return offset;
   }
   else {
@@ -298,26 +457,60 @@ uint64_t alloc_data(const char* data, uint64_t size) {
   }
 }
 
-void free_data(uint64_t offset) {
+/*
+ * allocate a space for a data and write it
+ * return the offset of the new data
+ */
+uint64_t alloc_data(uint64_t key, const char* data, uint64_t size) {
+  if (store == STORE_LOG)
+    return log_append(key, data, size);
+
+  uint64_t offset = alloc_block(size + sizeof(uint64_t));
+  file_write(dat_fp, offset, &size, sizeof(size));
+  file_write(dat_fp, offset + sizeof(size), data, size);
+  file_flush(dat_fp);
+  return offset;
+}
+
+/*
+ * allocate extents until they cover `size` bytes
+ * return the bytes covered, which is less than `size` if extents run out
+ * - the k-th extent has `MIN_EXTENT_SIZE << k` bytes, up to `MAX_EXTENT_SIZE`.
+ */
+static uint64_t grow_extents(extent_head* head, uint64_t size) {
+  uint64_t cap = 0;
+  for (uint64_t i = 0; i < head->count; i++)
+    cap += head->extents[i].size;
+  while (cap < size && head->count < MAX_EXTENTS) {
+    uint64_t elen = head->count < 14 ? (uint64_t)MIN_EXTENT_SIZE << head->count : MAX_EXTENT_SIZE;
+    head->extents[head->count].offset = alloc_block(elen);
+    head->extents[head->count].size = elen;
+    head->count++;
+    cap += elen;
+  }
+  return cap;
+}
+
+/*
+ * free a block allocated by `alloc_block()`
+ */
+static void free_block(uint64_t offset) {
   header_t header;
 
   offset -= sizeof(header_t);
 
-  fseek(dat_fp, offset, SEEK_SET);
-  Fread(&header, sizeof(header), 1, dat_fp);
+  file_read(dat_fp, offset, &header, sizeof(header));
 
   assert(header.next == MAGIC);
   
   uint64_t pp = HEAD;
   uint64_t p = NULL_OFF;
 
-  fseek(dat_fp, pp, SEEK_SET);
-  Fread(&p, sizeof(p), 1, dat_fp);
+  file_read(dat_fp, pp, &p, sizeof(p));
 
   while (p != NULL_OFF && p < offset) {
     pp = p + sizeof(header.size);
-    fseek(dat_fp, pp, SEEK_SET);
-    Fread(&p, sizeof(p), 1, dat_fp);
+    file_read(dat_fp, pp, &p, sizeof(p));
   }
 
   header.next = p;
@@ -329,46 +522,360 @@ void free_data(uint64_t offset) {
 
   if (next_off != NULL_OFF && offset + sizeof(header_t) + header.size == next_off) {
     header_t next; 
-    fseek(dat_fp, next_off, SEEK_SET);
-    Fread(&next, sizeof(next), 1, dat_fp);
+    file_read(dat_fp, next_off, &next, sizeof(next));
     
     header.size += sizeof(header_t) + next.size;
     header.next = next.next;
-    fseek(dat_fp, offset, SEEK_SET);
-    fwrite(&header, sizeof(header), 1, dat_fp);
+    file_write(dat_fp, offset, &header, sizeof(header));
   }
   else {
-    fseek(dat_fp, offset, SEEK_SET);
-    fwrite(&header, sizeof(header), 1, dat_fp);
+    file_write(dat_fp, offset, &header, sizeof(header));
   }
   
   if (pp != HEAD) {
     uint64_t prev_off = pp - sizeof(header.size);
     header_t prev;
-    fseek(dat_fp, prev_off, SEEK_SET);
-    Fread(&prev, sizeof(prev), 1, dat_fp);
+    file_read(dat_fp, prev_off, &prev, sizeof(prev));
 
     if (prev_off + sizeof(header_t) + prev.size == offset) {
       prev.size += sizeof(header_t) + header.size;
       prev.next = header.next;
-      fseek(dat_fp, prev_off, SEEK_SET);
-      fwrite(&prev, sizeof(prev), 1, dat_fp);
+      file_write(dat_fp, prev_off, &prev, sizeof(prev));
     }
     else {
-      fseek(dat_fp, pp, SEEK_SET);
-      fwrite(&p, sizeof(p), 1, dat_fp);
+      file_write(dat_fp, pp, &p, sizeof(p));
     }
   }
   else {
-    fseek(dat_fp, pp, SEEK_SET);
-    fwrite(&p, sizeof(p), 1, dat_fp);
+    file_write(dat_fp, pp, &p, sizeof(p));
   }
 
-    fseek(dat_fp, HEAD, SEEK_SET);
-    Fread(&dat_header, sizeof(dat_header), 1, dat_fp);
+    file_read(dat_fp, HEAD, &dat_header, sizeof(dat_header));
     dat_header.size--;
-    fseek(dat_fp, HEAD, SEEK_SET);
-    fwrite(&dat_header, sizeof(dat_header), 1, dat_fp);
+    file_write(dat_fp, HEAD, &dat_header, sizeof(dat_header));
+    file_flush(dat_fp);
+}
+
+void free_data(uint64_t offset) {
+  if (store == STORE_LOG) {
+    log_free(offset);
+    return;
+  }
+
+  uint64_t size;
+  file_read(dat_fp, offset, &size, sizeof(size));
+  if (size & EXTENT) {
+    extent_head head;
+    read_head(&head, offset);
+    for (uint64_t i = 0; i < head.count; i++)
+      free_block(head.extents[i].offset);
+  }
+  free_block(offset);
+}
+
+/*
+ * hash index
+ *
+ * linear hashing over buckets, a bucket is a bpnode of type BUCKET.
+ * - `keys` and `children` hold keys and addresses of data, `next` is the
+ *   overflow bucket.
+ * - there are `(1 << level) + split` buckets, bucket `split` is the next
+ *   one to split. a key goes to `hash % (1 << level)`, or to
+ *   `hash % (2 << level)` if that bucket is already split.
+ * - offsets of buckets are kept in directory pages, bpnodes of type
+ *   DIRECTORY chained by `next` from `idx_header.root`. the directory is
+ *   also kept in memory, so a lookup reads about one bucket.
+ * - keys are hashed by `hash_key()` of cache.c.
+ */
+
+static uint64_t bucket_of(uint64_t key) {
+  uint64_t h = hash_key(key);
+  uint64_t b = h & ((1ull << idx_header.level) - 1);
+  if (b < idx_header.split)
+    b = h & ((2ull << idx_header.level) - 1);
+  return b;
+}
+
+static uint64_t bucket_count() {
+  return (1ull << idx_header.level) + idx_header.split;
+}
+
+/*
+ * write the directory page holding bucket `b`
+ */
+static void update_dir(uint64_t b) {
+  uint64_t p = b / ORDER;
+  bpnode page;
+  memset(&page, 0, sizeof(page));
+  page.type = DIRECTORY;
+  for (uint64_t i = p * ORDER; i < (p + 1) * ORDER && i < bucket_count(); i++) {
+    page.children[i - p * ORDER] = dir[i];
+    page.size++;
+  }
+  page.next = p + 1 < dir_pages_count ? dir_pages[p + 1] : NULL_OFF;
+  update_node(&page, dir_pages[p]);
+}
+
+/*
+ * set the offset of bucket `b`, growing the directory if needed
+ */
+static void set_dir(uint64_t b, uint64_t offset) {
+  if (b >= dir_cap) {
+    dir_cap = dir_cap == 0 ? ORDER : dir_cap * 2;
+    dir = realloc(dir, dir_cap * sizeof(uint64_t));
+    dir_pages = realloc(dir_pages, (dir_cap / ORDER) * sizeof(uint64_t));
+  }
+  dir[b] = offset;
+  if (b / ORDER >= dir_pages_count) { // new page
+    bpnode page;
+    memset(&page, 0, sizeof(page));
+    page.type = DIRECTORY;
+    dir_pages[dir_pages_count++] = alloc_node(&page);
+    if (dir_pages_count > 1)
+      update_dir(b - ORDER);
+    else {
+      idx_header.root = dir_pages[0];
+      update_idx_header();
+    }
+  }
+}
+
+/*
+ * create an empty hash index
+ */
+static void hash_create() {
+  bpnode bucket;
+  memset(&bucket, 0, sizeof(bucket));
+  bucket.type = BUCKET;
+  idx_header.level = 0;
+  idx_header.split = 0;
+  idx_header.keys = 0;
+  set_dir(0, alloc_node(&bucket));
+  update_dir(0);
+  update_idx_header();
+}
+
+/*
+ * load the directory of an existing hash index
+ */
+static void hash_open() {
+  uint64_t n = bucket_count();
+  uint64_t offset = idx_header.root;
+  bpnode page;
+  for (uint64_t b = 0; b < n; b++) {
+    if (b % ORDER == 0) {
+      read_node(&page, offset);
+      if (b >= dir_cap) {
+        dir_cap = dir_cap == 0 ? ORDER : dir_cap * 2;
+        dir = realloc(dir, dir_cap * sizeof(uint64_t));
+        dir_pages = realloc(dir_pages, (dir_cap / ORDER) * sizeof(uint64_t));
+      }
+      dir_pages[dir_pages_count++] = offset;
+      offset = page.next;
+    }
+    dir[b] = page.children[b % ORDER];
+  }
+}
+
+static uint64_t hash_lookup(uint64_t key) {
+  bpnode bucket;
+  uint64_t offset = dir[bucket_of(key)];
+  while (offset != NULL_OFF) {
+    read_node(&bucket, offset);
+    for (int i = 0; i < bucket.size; i++)
+      if (bucket.keys[i] == key)
+        return bucket.children[i];
+    offset = bucket.next;
+  }
+  return NULL_OFF;
+}
+
+/*
+ * point the entry of `key` to a moved data
+ */
+static void hash_relocate(uint64_t key, uint64_t ptr) {
+  bpnode bucket;
+  uint64_t offset = dir[bucket_of(key)];
+  while (offset != NULL_OFF) {
+    read_node(&bucket, offset);
+    for (int i = 0; i < bucket.size; i++) {
+      if (bucket.keys[i] == key) {
+        bucket.children[i] = ptr;
+        update_node(&bucket, offset);
+        return;
+      }
+    }
+    offset = bucket.next;
+  }
+}
+
+/*
+ * rewrite the chain of bucket `b` with `n` entries
+ * - reuse buckets of the old chain, allocate or free buckets as needed.
+ */
+static void write_chain(uint64_t b, const uint64_t* keys, const uint64_t* ptrs, uint64_t n) {
+  uint64_t m = n == 0 ? 1 : (n + ORDER - 1) / ORDER;
+  uint64_t* offsets = malloc(m * sizeof(uint64_t));
+  uint64_t nold = 0;
+  bpnode bucket;
+  for (uint64_t offset = dir[b]; offset != NULL_OFF; offset = bucket.next) {
+    read_node(&bucket, offset);
+    if (nold < m)
+      offsets[nold] = offset;
+    else
+      free_node(offset);
+    nold++;
+  }
+
+  memset(&bucket, 0, sizeof(bucket));
+  bucket.type = BUCKET;
+  for (uint64_t i = nold; i < m; i++)
+    offsets[i] = alloc_node(&bucket);
+
+  for (uint64_t i = 0; i < m; i++) {
+    bucket.size = 0;
+    for (uint64_t j = i * ORDER; j < n && j < (i + 1) * ORDER; j++) {
+      bucket.keys[bucket.size] = keys[j];
+      bucket.children[bucket.size] = ptrs[j];
+      bucket.size++;
+    }
+    bucket.next = i + 1 < m ? offsets[i + 1] : NULL_OFF;
+    update_node(&bucket, offsets[i]);
+  }
+  free(offsets);
+}
+
+/*
+ * split bucket `split` into itself and a new bucket at the end
+ */
+static void hash_split() {
+  uint64_t b = idx_header.split;
+  uint64_t nb = bucket_count();
+
+  uint64_t cap = ORDER;
+  uint64_t* keys = malloc(cap * sizeof(uint64_t));
+  uint64_t* ptrs = malloc(cap * sizeof(uint64_t));
+  uint64_t n = 0;
+  bpnode bucket;
+  for (uint64_t offset = dir[b]; offset != NULL_OFF; offset = bucket.next) {
+    read_node(&bucket, offset);
+    if (n + bucket.size > cap) {
+      cap *= 2;
+      keys = realloc(keys, cap * sizeof(uint64_t));
+      ptrs = realloc(ptrs, cap * sizeof(uint64_t));
+    }
+    for (int i = 0; i < bucket.size; i++) {
+      keys[n] = bucket.keys[i];
+      ptrs[n] = bucket.children[i];
+      n++;
+    }
+  }
+
+  // entries staying in `b` go to the front, the others to the back
+  uint64_t lo = 0;
+  uint64_t mask = (2ull << idx_header.level) - 1;
+  for (uint64_t i = 0; i < n; i++) {
+    if ((hash_key(keys[i]) & mask) == b) {
+      uint64_t k = keys[i], p = ptrs[i];
+      keys[i] = keys[lo];
+      ptrs[i] = ptrs[lo];
+      keys[lo] = k;
+      ptrs[lo] = p;
+      lo++;
+    }
+  }
+
+  memset(&bucket, 0, sizeof(bucket));
+  bucket.type = BUCKET;
+  set_dir(nb, alloc_node(&bucket));
+  idx_header.split++;
+  if (idx_header.split == (1ull << idx_header.level)) {
+    idx_header.level++;
+    idx_header.split = 0;
+  }
+  update_idx_header();
+  update_dir(nb);
+
+  write_chain(b, keys, ptrs, lo);
+  write_chain(nb, keys + lo, ptrs + lo, n - lo);
+  free(keys);
+  free(ptrs);
+}
+
+/*
+ * insert `key` with `data`, or with the data at `ptr` if it is not NULL_OFF
+ * return ERR if `key` exists, and `data` is not written then
+ * - split one bucket when the index gets too full.
+ */
+static int hash_insert(uint64_t key, const char* data, uint64_t size, uint64_t ptr) {
+  bpnode bucket;
+  uint64_t b = bucket_of(key);
+  uint64_t offset = dir[b];
+  for (;;) {
+    read_node(&bucket, offset);
+    for (int i = 0; i < bucket.size; i++)
+      if (bucket.keys[i] == key)
+        return ERR;
+    if (bucket.next == NULL_OFF)
+      break;
+    offset = bucket.next;
+  }
+
+  if (ptr == NULL_OFF)
+    ptr = alloc_data(key, data, size);
+  if (bucket.size < ORDER) {
+    bucket.keys[bucket.size] = key;
+    bucket.children[bucket.size] = ptr;
+    bucket.size++;
+    update_node(&bucket, offset);
+  }
+  else { // overflow
+    bpnode overflow;
+    memset(&overflow, 0, sizeof(overflow));
+    overflow.type = BUCKET;
+    overflow.size = 1;
+    overflow.keys[0] = key;
+    overflow.children[0] = ptr;
+    bucket.next = alloc_node(&overflow);
+    update_node(&bucket, offset);
+  }
+
+  idx_header.keys++;
+  update_idx_header();
+  if (idx_header.keys * 100 > bucket_count() * ORDER * HASH_LOAD)
+    hash_split();
+  return OK;
+}
+
+static int hash_erase(uint64_t key) {
+  bpnode bucket, prev;
+  uint64_t prev_off = NULL_OFF;
+  uint64_t offset = dir[bucket_of(key)];
+  while (offset != NULL_OFF) {
+    read_node(&bucket, offset);
+    for (int i = 0; i < bucket.size; i++) {
+      if (bucket.keys[i] == key) {
+        free_data(bucket.children[i]);
+        bucket.size--;
+        bucket.keys[i] = bucket.keys[bucket.size];
+        bucket.children[i] = bucket.children[bucket.size];
+        if (bucket.size == 0 && prev_off != NULL_OFF) { // drop empty overflow bucket
+          prev.next = bucket.next;
+          update_node(&prev, prev_off);
+          free_node(offset);
+        }
+        else
+          update_node(&bucket, offset);
+        idx_header.keys--;
+        update_idx_header();
+        return OK;
+      }
+    }
+    prev = bucket;
+    prev_off = offset;
+    offset = bucket.next;
+  }
+  return ERR;
 }
 
 static void split_ith_child(uint64_t offset, int i) {
@@ -382,6 +889,8 @@ static void split_ith_child(uint64_t offset, int i) {
     right.keys[j] = left.keys[j + ORDER / 2];
   for (int j = 0; j < ORDER / 2; j++)
     right.children[j] = left.children[j + ORDER / 2];
+  for (int j = 0; j < ORDER / 2; j++)
+    right.counts[j] = left.counts[j + ORDER / 2];
   if (left.type == LEAF)
     right.next = left.next;
   // set left
@@ -389,6 +898,10 @@ static void split_ith_child(uint64_t offset, int i) {
   // set p
   for (int j = parent.size - 1; j > i; j--)
     parent.children[j + 1] = parent.children[j];
+  for (int j = parent.size - 1; j > i; j--)
+    parent.counts[j + 1] = parent.counts[j];
+  parent.counts[i] = node_count(&left);
+  parent.counts[i + 1] = node_count(&right);
   parent.children[i + 1] = alloc_node(&right);
   if (left.type == LEAF)
     left.next = parent.children[i + 1];
@@ -401,7 +914,9 @@ static void split_ith_child(uint64_t offset, int i) {
   update_node(&right, parent.children[i + 1]);
 }
 
-static int insert_nonfull(uint64_t offset, uint64_t key, const char* data, uint64_t size) {
+static void gc_step(int budget);
+
+static int insert_nonfull(uint64_t offset, uint64_t key, const char* data, uint64_t size, uint64_t ptr) {
   // read node
   bpnode root;
   read_node(&root, offset);
@@ -410,13 +925,15 @@ static int insert_nonfull(uint64_t offset, uint64_t key, const char* data, uint6
     for (int i = 0; i < root.size; i++)
       if (root.keys[i] == key)
         return ERR;
+    if (ptr == NULL_OFF)
+      ptr = alloc_data(key, data, size);
     int i;
     for (i = root.size - 1; i >= 0 && key < root.keys[i]; i--)
       root.keys[i + 1] = root.keys[i];
     for (i = root.size - 1; i >= 0 && key < root.keys[i]; i--)
       root.children[i + 1] = root.children[i];
     root.keys[i + 1] = key;
-    root.children[i + 1] = alloc_data(data, size);
+    root.children[i + 1] = ptr;
     root.size++;
     update_node(&root, offset);
     return OK;
@@ -437,18 +954,29 @@ static int insert_nonfull(uint64_t offset, uint64_t key, const char* data, uint6
       if (key > root.keys[i])
         i++;
     }
-    return insert_nonfull(root.children[i], key, data, size);
+    if (!insert_nonfull(root.children[i], key, data, size, ptr))
+      return ERR;
+    root.counts[i]++;
+    update_node(&root, offset);
+    return OK;
   }
 }
 
-int insert(uint64_t key, const char* data, uint64_t size) {
-  if (idx_header.root == 0) {
+/*
+ * insert `key` with `data`, or with the data at `ptr` if it is not NULL_OFF
+ * return ERR if `key` exists, and `data` is not written then
+ * - the duplicate check is done at the leaf, so the index is walked once.
+ */
+static int insert_ptr(uint64_t key, const char* data, uint64_t size, uint64_t ptr) {
+  if (index_type == INDEX_HASH)
+    return hash_insert(key, data, size, ptr);
+  else if (idx_header.root == 0) {
     bpnode root;
     root.type = 0x02; // leaf
     root.size = 1;
     root.keys[0] = key;
     root.next = 0x0; // null
-    root.children[0] = alloc_data(data, size);
+    root.children[0] = ptr == NULL_OFF ? alloc_data(key, data, size) : ptr;
     idx_header.root = alloc_node(&root);
     idx_header.height++;
     update_idx_header();
@@ -463,15 +991,24 @@ int insert(uint64_t key, const char* data, uint64_t size) {
       parent.size = 1;
       parent.keys[0] = root.keys[ORDER - 1];
       parent.children[0] = idx_header.root;
+      parent.counts[0] = node_count(&root);
       idx_header.root = alloc_node(&parent);
       split_ith_child(idx_header.root, 0);
       idx_header.height++;
       update_idx_header();
     }
-    return insert_nonfull(idx_header.root, key, data, size);
+    return insert_nonfull(idx_header.root, key, data, size, ptr);
   }
 }
 
+int insert(uint64_t key, const char* data, uint64_t size) {
+  cache_erase(key);
+  if (!insert_ptr(key, data, size, NULL_OFF))
+    return ERR;
+  gc_step(GC_STEP);
+  return OK;
+}
+
 static uint64_t find_recursive(uint64_t key, uint64_t offset) {
   bpnode root;
   read_node(&root, offset);
@@ -493,27 +1030,108 @@ static uint64_t find_recursive(uint64_t key, uint64_t offset) {
   }
 }
 
+/*
+ * return the address of data of `key`, or NULL_OFF
+ */
+static uint64_t lookup(uint64_t key) {
+  if (index_type == INDEX_HASH)
+    return hash_lookup(key);
+  else if (idx_header.root == 0)
+    return NULL_OFF;
+  else
+    return find_recursive(key, idx_header.root);
+}
+
 data_t* find(uint64_t key) {
-  if (idx_header.height == 0) {
+  if (index_type == INDEX_BPTREE && idx_header.height == 0) {
     data_t* data = malloc(sizeof(data_t));
     data->size = 0;
     data->data = NULL;
     return data;
   }
   else {
-    uint64_t offset = find_recursive(key, idx_header.root);
+    data_t* data = cache_get(key);
+    if (data != NULL)
+      return data;
+    uint64_t offset = lookup(key);
     if (offset == NULL_OFF) {
-      data_t* data = malloc(sizeof(data_t));
+      data = malloc(sizeof(data_t));
       data->size = 0;
       data->data = NULL;
       return data;
     }
     else {
-      return read_data(offset);
+      data = read_data(offset);
+      cache_put(key, data->data, data->size);
+      return data;
     }
   }
 }
 
+static uint64_t rank_recursive(uint64_t key, uint64_t offset) {
+  bpnode root;
+  read_node(&root, offset);
+  int i;
+  uint64_t res = 0;
+  if (root.type == BRANCH) {
+    for (i = 0; i < root.size && key > root.keys[i]; i++)
+      res += root.counts[i];
+    if (i == root.size)
+      return res;
+    else
+      return res + rank_recursive(key, root.children[i]);
+  }
+  else {
+    for (i = 0; i < root.size && key > root.keys[i]; i++);
+    return i;
+  }
+}
+
+/*
+ * return the number of keys less than `key`
+ */
+uint64_t rank(uint64_t key) {
+  if (index_type == INDEX_HASH || idx_header.height == 0)
+    return 0;
+  else
+    return rank_recursive(key, idx_header.root);
+}
+
+/*
+ * return the number of keys in [left, right)
+ */
+uint64_t count_range(uint64_t left, uint64_t right) {
+  if (left >= right)
+    return 0;
+  return rank(right) - rank(left);
+}
+
+/*
+ * find the k-th smallest key (count from 0) and store it to `key`
+ * return ERR if there are not so many keys
+ */
+int select_key(uint64_t k, uint64_t* key) {
+  if (index_type == INDEX_HASH || idx_header.height == 0)
+    return ERR;
+  bpnode root;
+  uint64_t offset = idx_header.root;
+  for (;;) {
+    read_node(&root, offset);
+    if (root.type == LEAF)
+      break;
+    int i;
+    for (i = 0; i < root.size && k >= root.counts[i]; i++)
+      k -= root.counts[i];
+    if (i == root.size)
+      return ERR;
+    offset = root.children[i];
+  }
+  if (k >= root.size)
+    return ERR;
+  *key = root.keys[k];
+  return OK;
+}
+
 /*
 static uint64_t find_node_recursive(uint64_t key, uint64_t offset) {
   bpnode root;
@@ -552,29 +1170,98 @@ char** find_range(uint64_t left, uint64_t right) {
 }
 */
 
+/*
+ * merge the (i + 1)-th child into the i-th child
+ * - the two children must fit in one node.
+ */
 static void merge_child(uint64_t offset, int i) {
   bpnode root, left, right;
   read_node(&root, offset);
   read_node(&left, root.children[i]);
   read_node(&right, root.children[i + 1]);
+  assert(left.size + right.size <= ORDER);
   // set left
-  for (int j = 0; j < ORDER / 2; j++)
-    left.keys[j + ORDER / 2] = right.keys[j];
-  for (int j = 0; j < ORDER / 2; j++)
-    left.children[j + ORDER / 2] = right.children[j];
-  left.size = ORDER;
+  for (int j = 0; j < right.size; j++)
+    left.keys[j + left.size] = right.keys[j];
+  for (int j = 0; j < right.size; j++)
+    left.children[j + left.size] = right.children[j];
+  for (int j = 0; j < right.size; j++)
+    left.counts[j + left.size] = right.counts[j];
+  if (left.type == LEAF)
+    left.next = right.next;
+  left.size += right.size;
   update_node(&left, root.children[i]);
   // set right
   free_node(root.children[i + 1]);
   // set root
+  root.counts[i] += root.counts[i + 1];
   root.size--;
   for (int j = i; j < root.size; j++)
     root.keys[j] = root.keys[j + 1];
   for (int j = i + 1; j < root.size; j++)
     root.children[j] = root.children[j + 1];
+  for (int j = i + 1; j < root.size; j++)
+    root.counts[j] = root.counts[j + 1];
   update_node(&root, offset);
 }
 
+/*
+ * merge adjacent children of a subtree while they fit in one node
+ */
+static void rebalance_recursive(uint64_t offset) {
+  bpnode root, left, right;
+  read_node(&root, offset);
+  if (root.type == LEAF)
+    return;
+  int i = 0;
+  while (i < root.size - 1) {
+    read_node(&left, root.children[i]);
+    read_node(&right, root.children[i + 1]);
+    if (left.size + right.size <= ORDER - ORDER / 4) {
+      merge_child(offset, i);
+      read_node(&root, offset);
+    }
+    else
+      i++;
+  }
+  for (i = 0; i < root.size; i++)
+    rebalance_recursive(root.children[i]);
+}
+
+/*
+ * choose when erase() merges or borrows
+ * - REBALANCE_EAGER keeps every node at least half full.
+ * - REBALANCE_LAZY lets a node drop to a quarter full.
+ * - REBALANCE_EMPTY only acts when a node would become empty.
+ */
+void set_rebalance(int policy) {
+  if (policy == REBALANCE_LAZY)
+    min_fill = ORDER / 4;
+  else if (policy == REBALANCE_EMPTY)
+    min_fill = 1;
+  else
+    min_fill = ORDER / 2;
+}
+
+/*
+ * merge underfull nodes left behind by a lazy policy
+ * - visits every node, call it when the database is idle.
+ */
+void rebalance() {
+  if (index_type == INDEX_HASH || idx_header.root == 0)
+    return;
+  rebalance_recursive(idx_header.root);
+  bpnode root;
+  read_node(&root, idx_header.root);
+  while (root.size == 1 && root.type == BRANCH) {
+    free_node(idx_header.root);
+    idx_header.root = root.children[0];
+    idx_header.height--;
+    read_node(&root, idx_header.root);
+  }
+  update_idx_header();
+}
+
 static int find_idx(bpnode node, uint64_t key) {
   int i;
   for (i = 0; i < node.size; i++)
@@ -606,28 +1293,32 @@ static int erase_nonunderflow(uint64_t offset, uint64_t key) {
   else {
     bpnode node;
     read_node(&node, root.children[i]);
-    if (node.size == ORDER / 2) { // underflow
+    if (node.size <= min_fill) { // underflow
       int underflow = 1;
       if (i > 0) { // left exist
         bpnode left;
         read_node(&left, root.children[i - 1]);
-        if (left.size != ORDER / 2) { // left is not underflow
+        if (left.size > min_fill) { // left is not underflow
           // set node
-          for (int j = ORDER / 2; j > 0; j--)
+          for (int j = node.size; j > 0; j--)
             node.keys[j] = node.keys[j - 1];
           node.keys[0] = left.keys[left.size - 1];
-          for (int j = ORDER / 2; j > 0; j--)
+          for (int j = node.size; j > 0; j--)
             node.children[j] = node.children[j - 1];
           node.children[0] = left.children[left.size - 1];
-          if (node.type == 0x01)   // leaf
-            node.children[0] = left.children[left.size - 1];
+          for (int j = node.size; j > 0; j--)
+            node.counts[j] = node.counts[j - 1];
+          node.counts[0] = left.counts[left.size - 1];
           node.size++;
           update_node(&node, root.children[i]);
           // set left
           left.size--;
           update_node(&left, root.children[i - 1]);
           // set root
+          uint64_t moved = node.type == LEAF ? 1 : node.counts[0];
           root.keys[i - 1] = left.keys[left.size - 1];
+          root.counts[i - 1] -= moved;
+          root.counts[i] += moved;
           update_node(&root, offset);
           underflow = 0;
         }
@@ -635,10 +1326,11 @@ static int erase_nonunderflow(uint64_t offset, uint64_t key) {
       if (underflow && i < root.size - 1) {
         bpnode right;
         read_node(&right, root.children[i + 1]);
-        if (right.size != ORDER / 2) { // right is not underflow
+        if (right.size > min_fill) { // right is not underflow
           // set node
           node.keys[node.size] = right.keys[0];
           node.children[node.size] = right.children[0];
+          node.counts[node.size] = right.counts[0];
           node.size++;
           update_node(&node, root.children[i]);
           // set right
@@ -647,9 +1339,14 @@ static int erase_nonunderflow(uint64_t offset, uint64_t key) {
             right.keys[j] = right.keys[j + 1];
           for (int j = 0; j < right.size; j++)
             right.children[j] = right.children[j + 1];
+          for (int j = 0; j < right.size; j++)
+            right.counts[j] = right.counts[j + 1];
           update_node(&right, root.children[i + 1]);
           // set root
+          uint64_t moved = node.type == LEAF ? 1 : node.counts[node.size - 1];
           root.keys[i] = node.keys[node.size - 1];
+          root.counts[i] += moved;
+          root.counts[i + 1] -= moved;
           update_node(&root, offset);
           underflow = 0;
         }
@@ -666,7 +1363,9 @@ static int erase_nonunderflow(uint64_t offset, uint64_t key) {
     int res = erase_nonunderflow(root.children[i], key);
     read_node(&root, offset);
     read_node(&node, root.children[i]);
-    if (root.keys[i] != node.keys[node.size - 1]) {
+    if (res == OK || root.keys[i] != node.keys[node.size - 1]) {
+      if (res == OK)
+        root.counts[i]--;
       root.keys[i] = node.keys[node.size - 1];
       update_node(&root, offset);
     }
@@ -675,8 +1374,15 @@ static int erase_nonunderflow(uint64_t offset, uint64_t key) {
 }
 
 int erase(uint64_t key) {
+  if (index_type == INDEX_HASH) {
+    cache_erase(key);
+    int res = hash_erase(key);
+    gc_step(GC_STEP);
+    return res;
+  }
   if (idx_header.root == 0)
     return ERR;
+  cache_erase(key);
   int res = erase_nonunderflow(idx_header.root, key);
   bpnode root;
   read_node(&root, idx_header.root);
@@ -692,13 +1398,12 @@ int erase(uint64_t key) {
     read_node(&root, idx_header.root);
   }
   update_idx_header();
+  gc_step(GC_STEP);
   return res;
 }
 
 int update(uint64_t key, const char* data, uint64_t size) {
-  if (idx_header.root == 0)
-    return ERR;
-  uint64_t offset = find_recursive(key, idx_header.root);
+  uint64_t offset = lookup(key);
   if (offset == NULL_OFF)
     return ERR;
   else {
@@ -708,8 +1413,281 @@ int update(uint64_t key, const char* data, uint64_t size) {
   return OK;
 }
 
+/*
+ * point the leaf entry of `key` to a moved value
+ */
+static void relocate_recursive(uint64_t key, uint64_t ptr, uint64_t offset) {
+  bpnode root;
+  read_node(&root, offset);
+  int i = find_idx(root, key);
+  if (root.type == BRANCH)
+    relocate_recursive(key, ptr, root.children[i]);
+  else {
+    root.children[i] = ptr;
+    update_node(&root, offset);
+  }
+}
+
+static void relocate(uint64_t key, uint64_t ptr) {
+  if (index_type == INDEX_HASH)
+    hash_relocate(key, ptr);
+  else
+    relocate_recursive(key, ptr, idx_header.root);
+}
+
+/*
+ * move at most `budget` values out of the segment being collected
+ * - only call it between operations, since it rewrites leaves.
+ * - a value is live if its key still points to it.
+ */
+static void gc_step(int budget) {
+  if (store != STORE_LOG)
+    return;
+  while (budget-- > 0) {
+    if (gc_seg == NULL_SEG) {
+      gc_seg = log_victim(gc_threshold);
+      gc_pos = 0;
+      if (gc_seg == NULL_SEG)
+        return;
+    }
+    uint64_t key, ptr;
+    if (!log_scan(gc_seg, &gc_pos, &key, &ptr)) {
+      // the moved copies and the index pointing to them must reach the
+      // files before the last copy is deleted, even inside a batch
+      file_sync();
+      fflush(idx_fp);
+      log_drop(gc_seg);
+      gc_seg = NULL_SEG;
+    }
+    else if (lookup(key) == ptr) {
+      data_t* data = log_read(ptr);
+      relocate(key, log_append(key, data->data, data->size));
+      log_free(ptr);
+      free(data->data);
+      free(data);
+    }
+  }
+}
+
+/*
+ * collect a segment of the log store once its live bytes drop below
+ * `threshold` percent
+ * - higher threshold gives less space and more rewriting.
+ * - `threshold` is clamped to [0, 100], above 100 gc() would never end.
+ */
+void set_gc(int threshold) {
+  if (threshold < 0)
+    threshold = 0;
+  if (threshold > 100)
+    threshold = 100;
+  gc_threshold = threshold;
+}
+
+/*
+ * collect every segment below the threshold now
+ */
+void gc() {
+  if (store != STORE_LOG)
+    return;
+  do
+    gc_step(GC_STEP);
+  while (gc_seg != NULL_SEG || log_victim(gc_threshold) != NULL_SEG);
+}
+
+/*
+ * point `stream` at the current data of its key
+ * return ERR if the key no longer exists
+ * - another stream or an update may have moved or grown the data.
+ */
+static int resolve(stream_t* stream) {
+  stream->ptr = lookup(stream->key);
+  if (stream->ptr == NULL_OFF)
+    return ERR;
+  if (store == STORE_LOG)
+    stream->size = log_size(stream->ptr);
+  else {
+    file_read(dat_fp, stream->ptr, &stream->size, sizeof(stream->size));
+    stream->size &= ~EXTENT;
+  }
+  return OK;
+}
+
+/*
+ * open the data of `key` for streaming
+ * return NULL if `key` does not exist
+ *
+ * - `size` is valid until the next insert, update, erase or write_value.
+ * - when stream is used, close_value(stream);
+ */
+stream_t* open_value(uint64_t key) {
+  stream_t* stream = malloc(sizeof(stream_t));
+  stream->key = key;
+  if (!resolve(stream)) {
+    free(stream);
+    return NULL;
+  }
+  return stream;
+}
+
+/*
+ * create an empty data of `key` in extents and open it for streaming
+ * return NULL if `key` exists or the store has no extents
+ */
+stream_t* create_value(uint64_t key) {
+  if (store == STORE_LOG)
+    return NULL;
+
+  extent_head head;
+  memset(&head, 0, sizeof(head));
+  head.size = EXTENT;
+  uint64_t ptr = alloc_block(sizeof(head));
+  update_head(&head, ptr);
+  cache_erase(key);
+  if (!insert_ptr(key, NULL, 0, ptr)) {
+    free_block(ptr);
+    return NULL;
+  }
+
+  stream_t* stream = malloc(sizeof(stream_t));
+  stream->key = key;
+  stream->ptr = ptr;
+  stream->size = 0;
+  return stream;
+}
+
+/*
+ * read at most `len` bytes from `pos` of the data
+ * return the number of bytes read, 0 if the key no longer exists
+ */
+uint64_t read_value(stream_t* stream, uint64_t pos, char* buf, uint64_t len) {
+  if (!resolve(stream) || pos >= stream->size)
+    return 0;
+  if (len > stream->size - pos)
+    len = stream->size - pos;
+
+  if (store == STORE_LOG) {
+    log_read_at(stream->ptr, pos, buf, len);
+    return len;
+  }
+
+  uint64_t size;
+  file_read(dat_fp, stream->ptr, &size, sizeof(size));
+  if (size & EXTENT) {
+    extent_head head;
+    read_head(&head, stream->ptr);
+    read_extents(&head, pos, buf, len);
+  }
+  else {
+    file_read(dat_fp, stream->ptr + sizeof(size) + pos, buf, len);
+  }
+  return len;
+}
+
+/*
+ * move a data written by `alloc_data()` into extents
+ * - copy it by chunks, so memory stays bounded.
+ */
+static uint64_t to_extents(uint64_t key, uint64_t ptr, uint64_t size, extent_head* head) {
+  memset(head, 0, sizeof(*head));
+  head->size = EXTENT;
+  uint64_t offset = alloc_block(sizeof(*head));
+
+  char* buf = malloc(STREAM_CHUNK);
+  uint64_t pos = 0;
+  while (pos < size) {
+    uint64_t n = size - pos < STREAM_CHUNK ? size - pos : STREAM_CHUNK;
+    file_read(dat_fp, ptr + sizeof(size) + pos, buf, n);
+    if (grow_extents(head, pos + n) < pos + n)
+      break;
+    write_extents(head, pos, buf, n);
+    pos += n;
+  }
+  free(buf);
+  head->size = EXTENT | pos;
+  update_head(head, offset);
+
+  relocate(key, offset);
+  free_block(ptr);
+  return offset;
+}
+
+/*
+ * write `len` bytes to `pos` of the data, growing it if needed
+ * return the number of bytes written, 0 if the key no longer exists
+ *
+ * - `pos` must not be beyond the end of the data.
+ * - a data inserted by `insert()` is moved into extents first.
+ */
+uint64_t write_value(stream_t* stream, uint64_t pos, const char* buf, uint64_t len) {
+  if (store == STORE_LOG || !resolve(stream) || pos > stream->size)
+    return 0;
+  cache_erase(stream->key);
+
+  extent_head head;
+  uint64_t size;
+  file_read(dat_fp, stream->ptr, &size, sizeof(size));
+  if (size & EXTENT)
+    read_head(&head, stream->ptr);
+  else
+    stream->ptr = to_extents(stream->key, stream->ptr, size, &head);
+
+  uint64_t cap = grow_extents(&head, pos + len);
+  if (pos + len > cap)
+    len = cap > pos ? cap - pos : 0;
+  write_extents(&head, pos, buf, len);
+  if (pos + len > stream->size)
+    stream->size = pos + len;
+  head.size = EXTENT | stream->size;
+  update_head(&head, stream->ptr);
+  return len;
+}
+
+void close_value(stream_t* stream) {
+  free(stream);
+}
+
+/*
+ * cache up to `bytes` bytes of records for find(), 0 to disable
+ */
+void set_cache(uint64_t bytes) {
+  cache_init(bytes);
+}
+
+/*
+ * keep writes in memory until `end_batch()`
+ * - reads inside the batch see them, and nothing reaches the files
+ *   before `end_batch()`, so a crash inside a batch loses all of it.
+ * - `end_batch()` writes each dirty page once, in offset order. the
+ *   files have no journal, so a crash while it writes can leave part of
+ *   the batch, as a crash inside a single insert() could before.
+ * - collecting a segment of the log store writes the batch early, so
+ *   the moved values are in the files before the segment is deleted.
+ */
+void begin_batch() {
+  file_batch(1);
+}
+
+/*
+ * write and flush everything written since `begin_batch()`
+ */
+void end_batch() {
+  file_batch(0);
+}
+
 void destroy() {
-  update_idx_header();
-  if (idx_fp != NULL)
+  file_batch(0);
+  cache_destroy();
+  if (store == STORE_LOG)
+    log_destroy();
+  free(dir);
+  free(dir_pages);
+  dir = NULL;
+  dir_pages = NULL;
+  dir_cap = 0;
+  dir_pages_count = 0;
+  if (idx_fp != NULL) {
+    update_idx_header();
     fclose(idx_fp);
+    idx_fp = NULL;
+  }
 }
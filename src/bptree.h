@@ -6,12 +6,32 @@
 
 #include <stdint.h>
 
+#define REBALANCE_EAGER 0
+#define REBALANCE_LAZY 1
+#define REBALANCE_EMPTY 2
+
+#define STORE_FREE_LIST 0
+#define STORE_LOG 1
+
+#define INDEX_BPTREE 0
+#define INDEX_HASH 1
+
 typedef struct {
   uint64_t size;
   char* data;
 } data_t;
 
-void init(const char* fn);
+typedef struct {
+  uint64_t key;
+  uint64_t ptr;
+  uint64_t size;
+} stream_t;
+
+void set_store(int store);
+
+void set_index(int type);
+
+int init(const char* fn);
 
 int insert(uint64_t key, const char* data, uint64_t size);
 
@@ -19,10 +39,40 @@ data_t* find(uint64_t key);
 
 // char** find_range(uint64_t left, uint64_t right);
 
+uint64_t rank(uint64_t key);
+
+uint64_t count_range(uint64_t left, uint64_t right);
+
+int select_key(uint64_t k, uint64_t* key);
+
 int erase(uint64_t key);
 
 int update(uint64_t key, const char* data, uint64_t size);
 
+void set_rebalance(int policy);
+
+void rebalance();
+
+void set_cache(uint64_t bytes);
+
+stream_t* open_value(uint64_t key);
+
+stream_t* create_value(uint64_t key);
+
+uint64_t read_value(stream_t* stream, uint64_t pos, char* buf, uint64_t len);
+
+uint64_t write_value(stream_t* stream, uint64_t pos, const char* buf, uint64_t len);
+
+void close_value(stream_t* stream);
+
+void set_gc(int threshold);
+
+void gc();
+
+void begin_batch();
+
+void end_batch();
+
 void destroy();
 
 #endif // _BPTREE_H_
@@ -0,0 +1,310 @@
+/*
+ * cache.c
+ *
+ * record cache in front of find().
+ * - bounded in bytes, split into shards, each shard has its own lock.
+ * - each shard keeps records in LRU order and admits a new record only
+ *   if it is used more often than the records it would evict (TinyLFU).
+ * - frequency is estimated by a count-min sketch which is halved
+ *   periodically, so old popularity fades away.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cache.h"
+
+#define SHARDS 16
+#define DEPTH 4
+#define MIN_WIDTH 256
+#define MAX_WIDTH 65536
+#define MIN_BUCKETS 64
+#define SAMPLE_FACTOR 10
+#define MAX_FREQ 15
+
+typedef struct entry {
+  uint64_t key;
+  uint64_t size;
+  char* data;
+  struct entry* hnext;
+  struct entry* prev; // LRU, towards head
+  struct entry* next; // LRU, towards tail
+} entry_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  entry_t** buckets;
+  uint64_t nbuckets;
+  uint64_t count;
+  entry_t* head; // most recently used
+  entry_t* tail; // least recently used
+  uint64_t used;
+  uint64_t capacity;
+  uint8_t* sketch; // DEPTH rows of width counters
+  uint64_t width;
+  uint64_t samples;
+} shard_t;
+
+static shard_t shards[SHARDS];
+static int enabled;
+
+/*
+ * splitmix64 finalizer, also used by the hash index of bptree.c
+ * - the hash index stores keys by it, so it must never change.
+ */
+uint64_t hash_key(uint64_t key) {
+  key += 0x9e3779b97f4a7c15;
+  key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9;
+  key = (key ^ (key >> 27)) * 0x94d049bb133111eb;
+  return key ^ (key >> 31);
+}
+
+static uint64_t entry_cost(uint64_t size) {
+  return size + sizeof(entry_t);
+}
+
+/*
+ * count-min sketch
+ */
+static uint8_t* sketch_counter(shard_t* shard, uint64_t h, int row) {
+  uint64_t idx = hash_key(h + row);
+  return &shard->sketch[row * shard->width + (idx & (shard->width - 1))];
+}
+
+static int sketch_freq(shard_t* shard, uint64_t h) {
+  int freq = MAX_FREQ;
+  for (int row = 0; row < DEPTH; row++) {
+    uint8_t c = *sketch_counter(shard, h, row);
+    if (c < freq)
+      freq = c;
+  }
+  return freq;
+}
+
+static void sketch_increment(shard_t* shard, uint64_t h) {
+  int freq = sketch_freq(shard, h);
+  if (freq < MAX_FREQ) { // conservative update
+    for (int row = 0; row < DEPTH; row++) {
+      uint8_t* c = sketch_counter(shard, h, row);
+      if (*c == freq)
+        (*c)++;
+    }
+  }
+  if (++shard->samples >= SAMPLE_FACTOR * shard->width) { // aging
+    for (uint64_t i = 0; i < DEPTH * shard->width; i++)
+      shard->sketch[i] >>= 1;
+    shard->samples /= 2;
+  }
+}
+
+/*
+ * LRU list
+ */
+static void lru_unlink(shard_t* shard, entry_t* e) {
+  if (e->prev != NULL)
+    e->prev->next = e->next;
+  else
+    shard->head = e->next;
+  if (e->next != NULL)
+    e->next->prev = e->prev;
+  else
+    shard->tail = e->prev;
+}
+
+static void lru_push(shard_t* shard, entry_t* e) {
+  e->prev = NULL;
+  e->next = shard->head;
+  if (shard->head != NULL)
+    shard->head->prev = e;
+  else
+    shard->tail = e;
+  shard->head = e;
+}
+
+/*
+ * hash table
+ */
+static entry_t** bucket_of(shard_t* shard, uint64_t h) {
+  return &shard->buckets[(h / SHARDS) & (shard->nbuckets - 1)];
+}
+
+static entry_t* lookup(shard_t* shard, uint64_t key, uint64_t h) {
+  entry_t* e = *bucket_of(shard, h);
+  while (e != NULL && e->key != key)
+    e = e->hnext;
+  return e;
+}
+
+static void grow(shard_t* shard) {
+  entry_t** old = shard->buckets;
+  uint64_t n = shard->nbuckets;
+  shard->nbuckets *= 2;
+  shard->buckets = calloc(shard->nbuckets, sizeof(entry_t*));
+  for (uint64_t i = 0; i < n; i++) {
+    entry_t* e = old[i];
+    while (e != NULL) {
+      entry_t* next = e->hnext;
+      entry_t** b = bucket_of(shard, hash_key(e->key));
+      e->hnext = *b;
+      *b = e;
+      e = next;
+    }
+  }
+  free(old);
+}
+
+/*
+ * unlink an entry from both the table and the LRU list, then free it
+ */
+static void remove_entry(shard_t* shard, entry_t* e) {
+  entry_t** p = bucket_of(shard, hash_key(e->key));
+  while (*p != e)
+    p = &(*p)->hnext;
+  *p = e->hnext;
+  lru_unlink(shard, e);
+  shard->used -= entry_cost(e->size);
+  shard->count--;
+  free(e->data);
+  free(e);
+}
+
+static void clear_shard(shard_t* shard) {
+  while (shard->head != NULL)
+    remove_entry(shard, shard->head);
+  free(shard->buckets);
+  free(shard->sketch);
+  shard->buckets = NULL;
+  shard->sketch = NULL;
+}
+
+/*
+ * enable the cache with at most `capacity` bytes
+ * - 0 disables it.
+ * - drop every record cached before.
+ */
+void cache_init(uint64_t capacity) {
+  cache_destroy();
+  if (capacity == 0)
+    return;
+
+  uint64_t width = MIN_WIDTH;
+  while (width < MAX_WIDTH && width * 64 < capacity / SHARDS)
+    width *= 2;
+
+  for (int i = 0; i < SHARDS; i++) {
+    shard_t* shard = &shards[i];
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->nbuckets = MIN_BUCKETS;
+    shard->buckets = calloc(shard->nbuckets, sizeof(entry_t*));
+    shard->count = 0;
+    shard->head = NULL;
+    shard->tail = NULL;
+    shard->used = 0;
+    shard->capacity = capacity / SHARDS;
+    shard->width = width;
+    shard->sketch = calloc(DEPTH * width, sizeof(uint8_t));
+    shard->samples = 0;
+  }
+  enabled = 1;
+}
+
+/*
+ * return a copy of the cached record, or NULL on miss
+ * - every call counts as one access for admission.
+ */
+data_t* cache_get(uint64_t key) {
+  if (!enabled)
+    return NULL;
+  uint64_t h = hash_key(key);
+  shard_t* shard = &shards[h % SHARDS];
+  data_t* data = NULL;
+
+  pthread_mutex_lock(&shard->lock);
+  sketch_increment(shard, h);
+  entry_t* e = lookup(shard, key, h);
+  if (e != NULL) {
+    lru_unlink(shard, e);
+    lru_push(shard, e);
+    data = malloc(sizeof(data_t));
+    data->size = e->size;
+    data->data = malloc(e->size * sizeof(char));
+    memcpy(data->data, e->data, e->size);
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  return data;
+}
+
+/*
+ * offer a record read from file to the cache
+ * - it may be rejected if the shard is full of more frequent records.
+ */
+void cache_put(uint64_t key, const char* data, uint64_t size) {
+  if (!enabled)
+    return;
+  uint64_t h = hash_key(key);
+  shard_t* shard = &shards[h % SHARDS];
+  uint64_t cost = entry_cost(size);
+
+  pthread_mutex_lock(&shard->lock);
+  if (cost > shard->capacity || lookup(shard, key, h) != NULL) {
+    pthread_mutex_unlock(&shard->lock);
+    return;
+  }
+  int freq = sketch_freq(shard, h);
+  uint64_t freed = 0;
+  entry_t* victim = shard->tail;
+  while (shard->used - freed + cost > shard->capacity) { // admission
+    if (sketch_freq(shard, hash_key(victim->key)) >= freq) {
+      pthread_mutex_unlock(&shard->lock);
+      return;
+    }
+    freed += entry_cost(victim->size);
+    victim = victim->prev;
+  }
+  while (shard->used + cost > shard->capacity)
+    remove_entry(shard, shard->tail);
+
+  entry_t* e = malloc(sizeof(entry_t));
+  e->key = key;
+  e->size = size;
+  e->data = malloc(size * sizeof(char));
+  memcpy(e->data, data, size);
+  entry_t** b = bucket_of(shard, h);
+  e->hnext = *b;
+  *b = e;
+  lru_push(shard, e);
+  shard->used += cost;
+  if (++shard->count > shard->nbuckets)
+    grow(shard);
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * drop a record, called whenever the record on file changes
+ */
+void cache_erase(uint64_t key) {
+  if (!enabled)
+    return;
+  uint64_t h = hash_key(key);
+  shard_t* shard = &shards[h % SHARDS];
+
+  pthread_mutex_lock(&shard->lock);
+  entry_t* e = lookup(shard, key, h);
+  if (e != NULL)
+    remove_entry(shard, e);
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * free every record and disable the cache
+ */
+void cache_destroy() {
+  if (!enabled)
+    return;
+  enabled = 0;
+  for (int i = 0; i < SHARDS; i++) {
+    clear_shard(&shards[i]);
+    pthread_mutex_destroy(&shards[i].lock);
+  }
+}
@@ -0,0 +1,23 @@
+/*
+ * cache.h
+ */
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stdint.h>
+
+#include "bptree.h"
+
+uint64_t hash_key(uint64_t key);
+
+void cache_init(uint64_t capacity);
+
+data_t* cache_get(uint64_t key);
+
+void cache_put(uint64_t key, const char* data, uint64_t size);
+
+void cache_erase(uint64_t key);
+
+void cache_destroy();
+
+#endif // _CACHE_H_
@@ -0,0 +1,259 @@
+/*
+ * client.c
+ *
+ * client of server.c.
+ * - `client_send()` only queues a request, so many requests can be
+ *   pipelined and sent by one `client_flush()`.
+ * - while the socket is full, `client_flush()` reads responses into the
+ *   buffer, since the server stops reading a peer which does not read.
+ * - `client_recv()` reads responses in the order of requests.
+ * - the other functions send one request and wait for its response,
+ *   they mirror the functions in bptree.h.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "client.h"
+#include "net.h"
+#include "protocol.h"
+
+#define BUF_SIZE (64 << 10)
+
+struct client {
+  int fd;
+  char* out;
+  uint64_t out_size;
+  uint64_t out_cap;
+  char* in;
+  uint64_t in_size;
+  uint64_t in_cap;
+  uint64_t in_pos; // start of the next response
+};
+
+/*
+ * connect to a server
+ * return NULL on error
+ */
+client_t* client_open(const char* addr) {
+  int fd = net_connect(addr);
+  if (fd < 0)
+    return NULL;
+  client_t* client = calloc(1, sizeof(client_t));
+  client->fd = fd;
+  return client;
+}
+
+void client_close(client_t* client) {
+  close(client->fd);
+  free(client->out);
+  free(client->in);
+  free(client);
+}
+
+/*
+ * queue a request
+ */
+void client_send(client_t* client, uint8_t op, uint64_t key, const char* body, uint32_t size) {
+  request_header req;
+  memset(&req, 0, sizeof(req));
+  req.op = op;
+  req.size = size;
+  req.key = key;
+
+  uint64_t need = client->out_size + sizeof(req) + size;
+  if (need > client->out_cap) {
+    uint64_t cap = client->out_cap == 0 ? BUF_SIZE : client->out_cap;
+    while (cap < need)
+      cap *= 2;
+    client->out = realloc(client->out, cap);
+    client->out_cap = cap;
+  }
+  memcpy(client->out + client->out_size, &req, sizeof(req));
+  if (size > 0)
+    memcpy(client->out + client->out_size + sizeof(req), body, size);
+  client->out_size = need;
+}
+
+/*
+ * make room for `size` more bytes of responses
+ */
+static void reserve_in(client_t* client, uint64_t size) {
+  if (client->in_size + size <= client->in_cap)
+    return;
+  if (client->in_pos > 0) {
+    memmove(client->in, client->in + client->in_pos, client->in_size - client->in_pos);
+    client->in_size -= client->in_pos;
+    client->in_pos = 0;
+  }
+  if (client->in_size + size > client->in_cap) {
+    uint64_t cap = client->in_cap == 0 ? BUF_SIZE : client->in_cap;
+    while (cap < client->in_size + size)
+      cap *= 2;
+    client->in = realloc(client->in, cap);
+    client->in_cap = cap;
+  }
+}
+
+/*
+ * buffer the responses which already arrived, without waiting
+ * return 0 on error
+ */
+static int drain(client_t* client) {
+  reserve_in(client, BUF_SIZE);
+  ssize_t n = recv(client->fd, client->in + client->in_size, client->in_cap - client->in_size, MSG_DONTWAIT);
+  if (n > 0)
+    client->in_size += n;
+  else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    return 0;
+  return 1;
+}
+
+/*
+ * send every queued request
+ * return 0 on error
+ */
+int client_flush(client_t* client) {
+  uint64_t pos = 0;
+  while (pos < client->out_size) {
+    ssize_t n = send(client->fd, client->out + pos, client->out_size - pos, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n > 0) {
+      pos += n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      return 0;
+    struct pollfd p;
+    p.fd = client->fd;
+    p.events = POLLIN | POLLOUT;
+    if (poll(&p, 1, -1) < 0 && errno != EINTR)
+      return 0;
+    if ((p.revents & POLLIN) && !drain(client))
+      return 0;
+  }
+  client->out_size = 0;
+  return 1;
+}
+
+/*
+ * make sure `size` bytes of response are buffered
+ */
+static int fill(client_t* client, uint64_t size) {
+  if (client->in_size - client->in_pos >= size)
+    return 1;
+  reserve_in(client, size - (client->in_size - client->in_pos));
+  while (client->in_size - client->in_pos < size) {
+    ssize_t n = read(client->fd, client->in + client->in_size, client->in_cap - client->in_size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    client->in_size += n;
+  }
+  return 1;
+}
+
+/*
+ * wait for the next response, flushing queued requests first
+ * return its status, or -1 on error
+ *
+ * - `*body` is valid until the next call.
+ */
+int client_recv(client_t* client, const char** body, uint32_t* size) {
+  if (client->out_size > 0 && !client_flush(client))
+    return -1;
+
+  response_header res;
+  if (!fill(client, sizeof(res)))
+    return -1;
+  memcpy(&res, client->in + client->in_pos, sizeof(res));
+  if (!fill(client, sizeof(res) + res.size))
+    return -1;
+  *body = client->in + client->in_pos + sizeof(res);
+  *size = res.size;
+  client->in_pos += sizeof(res) + res.size;
+  return res.status;
+}
+
+/*
+ * send one request and wait for its response
+ */
+static int call(client_t* client, uint8_t op, uint64_t key, const char* body, uint32_t size,
+                const char** res, uint32_t* res_size) {
+  client_send(client, op, key, body, size);
+  int status = client_recv(client, res, res_size);
+  return status < 0 ? STATUS_ERR : status;
+}
+
+int client_insert(client_t* client, uint64_t key, const char* data, uint64_t size) {
+  const char* body;
+  uint32_t n;
+  if (size > MAX_BODY)
+    return STATUS_ERR;
+  return call(client, OP_INSERT, key, data, size, &body, &n);
+}
+
+/*
+ * when data is used,
+ * - free(data->data);
+ * - free(data);
+ */
+data_t* client_find(client_t* client, uint64_t key) {
+  const char* body;
+  uint32_t n;
+  data_t* data = malloc(sizeof(data_t));
+  data->size = 0;
+  data->data = NULL;
+  if (call(client, OP_FIND, key, NULL, 0, &body, &n) == STATUS_OK) {
+    data->size = n;
+    data->data = malloc(n * sizeof(char));
+    memcpy(data->data, body, n);
+  }
+  return data;
+}
+
+int client_erase(client_t* client, uint64_t key) {
+  const char* body;
+  uint32_t n;
+  return call(client, OP_ERASE, key, NULL, 0, &body, &n);
+}
+
+int client_update(client_t* client, uint64_t key, const char* data, uint64_t size) {
+  const char* body;
+  uint32_t n;
+  if (size > MAX_BODY)
+    return STATUS_ERR;
+  return call(client, OP_UPDATE, key, data, size, &body, &n);
+}
+
+uint64_t client_rank(client_t* client, uint64_t key) {
+  const char* body;
+  uint32_t n;
+  uint64_t res = 0;
+  if (call(client, OP_RANK, key, NULL, 0, &body, &n) == STATUS_OK && n == sizeof(res))
+    memcpy(&res, body, sizeof(res));
+  return res;
+}
+
+uint64_t client_count_range(client_t* client, uint64_t left, uint64_t right) {
+  const char* body;
+  uint32_t n;
+  uint64_t res = 0;
+  if (call(client, OP_COUNT_RANGE, left, (const char*)&right, sizeof(right), &body, &n) == STATUS_OK && n == sizeof(res))
+    memcpy(&res, body, sizeof(res));
+  return res;
+}
+
+int client_select_key(client_t* client, uint64_t k, uint64_t* key) {
+  const char* body;
+  uint32_t n;
+  if (call(client, OP_SELECT, k, NULL, 0, &body, &n) != STATUS_OK || n != sizeof(*key))
+    return STATUS_ERR;
+  memcpy(key, body, sizeof(*key));
+  return STATUS_OK;
+}
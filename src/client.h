@@ -0,0 +1,37 @@
+/*
+ * client.h
+ */
+#ifndef _CLIENT_H_
+#define _CLIENT_H_
+
+#include <stdint.h>
+
+#include "bptree.h"
+
+typedef struct client client_t;
+
+client_t* client_open(const char* addr);
+
+void client_close(client_t* client);
+
+void client_send(client_t* client, uint8_t op, uint64_t key, const char* body, uint32_t size);
+
+int client_flush(client_t* client);
+
+int client_recv(client_t* client, const char** body, uint32_t* size);
+
+int client_insert(client_t* client, uint64_t key, const char* data, uint64_t size);
+
+data_t* client_find(client_t* client, uint64_t key);
+
+int client_erase(client_t* client, uint64_t key);
+
+int client_update(client_t* client, uint64_t key, const char* data, uint64_t size);
+
+uint64_t client_rank(client_t* client, uint64_t key);
+
+uint64_t client_count_range(client_t* client, uint64_t left, uint64_t right);
+
+int client_select_key(client_t* client, uint64_t k, uint64_t* key);
+
+#endif // _CLIENT_H_
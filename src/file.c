@@ -0,0 +1,181 @@
+/*
+ * file.c
+ *
+ * positioned reads and writes of database files, with write coalescing.
+ * - outside a batch, a write goes straight to the file.
+ * - inside a batch, a write lands in a dirty page kept in memory, and
+ *   reads see it. nothing reaches the file until the batch ends.
+ * - at the end of a batch, dirty pages are written once, in file and
+ *   offset order, adjacent pages in one write, then each file is flushed.
+ * - file pointer's position is unknown after you call any function.
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "file.h"
+
+#define PAGE_SIZE 4096
+#define SYNC_CHUNK (1 << 20)
+
+typedef struct {
+  FILE* fp;
+  uint64_t index; // offset / PAGE_SIZE
+  uint64_t len;   // bytes which exist in the file or were written
+  char data[PAGE_SIZE];
+} page_t;
+
+static page_t** pages; // dirty pages, sorted by file and index
+static uint64_t count;
+static uint64_t cap;
+static int batching;
+
+static int before(const page_t* page, FILE* fp, uint64_t index) {
+  if (page->fp != fp)
+    return (uintptr_t)page->fp < (uintptr_t)fp;
+  return page->index < index;
+}
+
+/*
+ * position of the first dirty page at or after `index` of `fp`
+ */
+static uint64_t lower_bound(FILE* fp, uint64_t index) {
+  uint64_t lo = 0, hi = count;
+  while (lo < hi) {
+    uint64_t mid = (lo + hi) / 2;
+    if (before(pages[mid], fp, index))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static int is_page(uint64_t i, FILE* fp, uint64_t index) {
+  return i < count && pages[i]->fp == fp && pages[i]->index == index;
+}
+
+/*
+ * make page `index` of `fp` dirty at position `i`
+ * - the page is read from the file first unless it will be overwritten.
+ */
+static page_t* add_page(uint64_t i, FILE* fp, uint64_t index, int whole) {
+  if (count == cap) {
+    cap = cap == 0 ? 64 : cap * 2;
+    pages = realloc(pages, cap * sizeof(page_t*));
+  }
+  memmove(pages + i + 1, pages + i, (count - i) * sizeof(page_t*));
+  count++;
+
+  page_t* page = malloc(sizeof(page_t));
+  page->fp = fp;
+  page->index = index;
+  page->len = 0;
+  if (!whole) {
+    fseek(fp, index * PAGE_SIZE, SEEK_SET);
+    page->len = fread(page->data, 1, PAGE_SIZE, fp);
+  }
+  memset(page->data + page->len, 0, PAGE_SIZE - page->len);
+  pages[i] = page;
+  return page;
+}
+
+void file_read(FILE* fp, uint64_t offset, void* buf, uint64_t len) {
+  char* p = buf;
+  uint64_t i = count > 0 ? lower_bound(fp, offset / PAGE_SIZE) : 0;
+  while (len > 0) {
+    uint64_t index = offset / PAGE_SIZE;
+    uint64_t n;
+    if (is_page(i, fp, index)) {
+      uint64_t in = offset % PAGE_SIZE;
+      n = PAGE_SIZE - in < len ? PAGE_SIZE - in : len;
+      memcpy(p, pages[i]->data + in, n);
+      i++;
+    }
+    else { // clean run, up to the next dirty page
+      n = len;
+      if (i < count && pages[i]->fp == fp && pages[i]->index * PAGE_SIZE - offset < n)
+        n = pages[i]->index * PAGE_SIZE - offset;
+      fseek(fp, offset, SEEK_SET);
+      fread(p, 1, n, fp);
+    }
+    p += n;
+    offset += n;
+    len -= n;
+  }
+}
+
+void file_write(FILE* fp, uint64_t offset, const void* buf, uint64_t len) {
+  if (!batching) {
+    fseek(fp, offset, SEEK_SET);
+    fwrite(buf, 1, len, fp);
+    return;
+  }
+
+  const char* p = buf;
+  uint64_t i = lower_bound(fp, offset / PAGE_SIZE);
+  while (len > 0) {
+    uint64_t index = offset / PAGE_SIZE;
+    uint64_t in = offset % PAGE_SIZE;
+    uint64_t n = PAGE_SIZE - in < len ? PAGE_SIZE - in : len;
+    page_t* page = is_page(i, fp, index) ? pages[i] : add_page(i, fp, index, n == PAGE_SIZE);
+    memcpy(page->data + in, p, n);
+    if (in + n > page->len)
+      page->len = in + n;
+    i++;
+    p += n;
+    offset += n;
+    len -= n;
+  }
+}
+
+/*
+ * flush `fp`, unless a batch will
+ */
+void file_flush(FILE* fp) {
+  if (!batching)
+    fflush(fp);
+}
+
+/*
+ * write every dirty page now and flush their files
+ * - works inside a batch too, for writes which must be durable before
+ *   something else happens.
+ */
+void file_sync() {
+  char* out = malloc(SYNC_CHUNK);
+  uint64_t size = 0;
+  uint64_t start = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    page_t* page = pages[i];
+    int adjacent = size > 0 && size + PAGE_SIZE <= SYNC_CHUNK && pages[i - 1]->fp == page->fp
+      && pages[i - 1]->index + 1 == page->index && pages[i - 1]->len == PAGE_SIZE;
+    if (!adjacent && size > 0) {
+      fseek(pages[i - 1]->fp, start, SEEK_SET);
+      fwrite(out, 1, size, pages[i - 1]->fp);
+      size = 0;
+    }
+    if (size == 0)
+      start = page->index * PAGE_SIZE;
+    memcpy(out + size, page->data, page->len);
+    size += page->len;
+    if (i + 1 == count || pages[i + 1]->fp != page->fp) {
+      fseek(page->fp, start, SEEK_SET);
+      fwrite(out, 1, size, page->fp);
+      fflush(page->fp);
+      size = 0;
+    }
+  }
+  for (uint64_t i = 0; i < count; i++)
+    free(pages[i]);
+  count = 0;
+  free(out);
+}
+
+/*
+ * keep writes in memory while `on`, write them out once it is turned off
+ */
+void file_batch(int on) {
+  batching = on;
+  if (!on)
+    file_sync();
+}
@@ -0,0 +1,20 @@
+/*
+ * file.h
+ */
+#ifndef _FILE_H_
+#define _FILE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+void file_read(FILE* fp, uint64_t offset, void* buf, uint64_t len);
+
+void file_write(FILE* fp, uint64_t offset, const void* buf, uint64_t len);
+
+void file_flush(FILE* fp);
+
+void file_sync();
+
+void file_batch(int on);
+
+#endif // _FILE_H_
@@ -0,0 +1,347 @@
+/*
+ * log.c
+ *
+ * log-structured value store.
+ * - values are appended to segment files `<fn>.<seg>.seg`, a full segment
+ *   is sealed and never written again.
+ * - a value is addressed by `(seg << OFF_BITS) | off`, seg counts from 1
+ *   so no address is NULL_OFF.
+ * - `<fn>.dat` keeps the live and total bytes of every segment, which
+ *   tells the garbage collector which segment is worth cleaning.
+ * - the number of a deleted segment is reused by the next new one, so
+ *   the manifest grows with the live data, not with all data ever written.
+ * - sealed segments below the gc threshold are kept in a list, so finding
+ *   a victim does not look at every segment.
+ * - file pointer's position is unknown after you call any function.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "file.h"
+#include "log.h"
+
+#define SEG_SIZE (4 << 20)
+#define OFF_BITS 40
+#define OFF_MASK ((1ull << OFF_BITS) - 1)
+#define HEAD 0x00
+#define NULL_SEG 0x00
+#define OK 1
+#define ERR 0
+
+typedef struct {
+  uint64_t key;
+  uint64_t size;
+} record_t;
+
+typedef struct {
+  uint64_t live;
+  uint64_t total;
+} seg_t;
+
+static char* log_fn;
+static FILE* man_fp; // manifest
+
+static struct {
+  uint64_t tail; // segment being appended
+  uint64_t end;  // append offset in tail
+  uint64_t count; // number of segment slots in the manifest
+} log_header;
+
+static seg_t* segs;   // segs[seg - 1]
+static FILE** seg_fp; // opened lazily
+static uint64_t seg_cap;
+
+static uint64_t* free_segs; // deleted segments, reused by new_seg()
+static uint64_t free_count;
+static uint64_t* candidates; // sealed segments below cand_threshold
+static uint64_t cand_count;
+static int cand_threshold = -1; // -1 until the list is built
+
+static size_t Fread(void* ptr, size_t size, size_t nmemb, FILE* stream) {
+  return fread(ptr, size, nmemb, stream);
+}
+
+static void seg_name(char* buf, size_t len, uint64_t seg) {
+  snprintf(buf, len, "%s.%lu.seg", log_fn, (unsigned long)seg);
+}
+
+static void update_log_header() {
+  file_write(man_fp, HEAD, &log_header, sizeof(log_header));
+  file_flush(man_fp);
+}
+
+static void update_seg(uint64_t seg) {
+  file_write(man_fp, sizeof(log_header) + (seg - 1) * sizeof(seg_t), &segs[seg - 1], sizeof(seg_t));
+  file_flush(man_fp);
+}
+
+static void reserve(uint64_t count) {
+  if (count <= seg_cap)
+    return;
+  uint64_t cap = seg_cap == 0 ? 16 : seg_cap;
+  while (cap < count)
+    cap *= 2;
+  segs = realloc(segs, cap * sizeof(seg_t));
+  seg_fp = realloc(seg_fp, cap * sizeof(FILE*));
+  free_segs = realloc(free_segs, cap * sizeof(uint64_t));
+  candidates = realloc(candidates, cap * sizeof(uint64_t));
+  for (uint64_t i = seg_cap; i < cap; i++)
+    seg_fp[i] = NULL;
+  seg_cap = cap;
+}
+
+static FILE* open_seg(uint64_t seg) {
+  if (seg_fp[seg - 1] == NULL) {
+    char buf[4096];
+    seg_name(buf, sizeof(buf), seg);
+    seg_fp[seg - 1] = fopen(buf, "rb+");
+    if (seg_fp[seg - 1] == NULL)
+      seg_fp[seg - 1] = fopen(buf, "wb+");
+  }
+  return seg_fp[seg - 1];
+}
+
+/*
+ * whether `seg` is sealed and its live bytes are below `threshold` percent
+ */
+static int below(uint64_t seg, int threshold) {
+  seg_t* s = &segs[seg - 1];
+  return threshold > 0 && seg != log_header.tail && s->total > 0 && s->live * 100 < s->total * threshold;
+}
+
+/*
+ * add `seg` to the candidates if it just went below the threshold
+ */
+static void consider(uint64_t seg) {
+  if (cand_threshold >= 0 && below(seg, cand_threshold))
+    candidates[cand_count++] = seg;
+}
+
+/*
+ * start a new tail segment, in the slot of a deleted one if any
+ */
+static void new_seg() {
+  uint64_t sealed = log_header.tail;
+  if (free_count > 0)
+    log_header.tail = free_segs[--free_count];
+  else {
+    log_header.count++;
+    reserve(log_header.count);
+    log_header.tail = log_header.count;
+  }
+  log_header.end = 0;
+  segs[log_header.tail - 1].live = 0;
+  segs[log_header.tail - 1].total = 0;
+  open_seg(log_header.tail);
+  update_seg(log_header.tail);
+  update_log_header();
+  if (sealed != NULL_SEG)
+    consider(sealed);
+}
+
+/*
+ * open the store of `fn`, create it if not exist
+ */
+void log_init(const char* fn) {
+  int len = strlen(fn);
+  log_fn = malloc(len + 1);
+  strcpy(log_fn, fn);
+
+  char* man_fn = malloc(len + 5);
+  strcpy(man_fn, fn);
+  strcpy(man_fn + len, ".dat");
+  man_fp = fopen(man_fn, "rb+");
+
+  if (man_fp == NULL) {
+    man_fp = fopen(man_fn, "wb+");
+    log_header.tail = NULL_SEG;
+    log_header.end = 0;
+    log_header.count = 0;
+    update_log_header();
+    new_seg();
+  }
+  else {
+    Fread(&log_header, sizeof(log_header), 1, man_fp);
+    reserve(log_header.count);
+    Fread(segs, sizeof(seg_t), log_header.count, man_fp);
+    for (uint64_t seg = log_header.count; seg >= 1; seg--)
+      if (seg != log_header.tail && segs[seg - 1].total == 0)
+        free_segs[free_count++] = seg;
+  }
+  free(man_fn);
+}
+
+/*
+ * append a value to the tail segment
+ * return the address of the value
+ */
+uint64_t log_append(uint64_t key, const char* data, uint64_t size) {
+  record_t rec;
+  rec.key = key;
+  rec.size = size;
+  uint64_t len = sizeof(rec) + size;
+
+  if (log_header.end > 0 && log_header.end + len > SEG_SIZE) // seal
+    new_seg();
+
+  uint64_t seg = log_header.tail;
+  uint64_t off = log_header.end;
+  FILE* fp = open_seg(seg);
+  file_write(fp, off, &rec, sizeof(rec));
+  file_write(fp, off + sizeof(rec), data, size);
+  file_flush(fp);
+
+  segs[seg - 1].live += len;
+  segs[seg - 1].total += len;
+  update_seg(seg);
+  log_header.end += len;
+  update_log_header();
+
+  return (seg << OFF_BITS) | off;
+}
+
+/*
+ * read one value
+ *
+ * when data is used,
+ * - free(data->data);
+ * - free(data);
+ */
+data_t* log_read(uint64_t ptr) {
+  FILE* fp = open_seg(ptr >> OFF_BITS);
+  record_t rec;
+  file_read(fp, ptr & OFF_MASK, &rec, sizeof(rec));
+
+  data_t* data = malloc(sizeof(data_t));
+  data->size = rec.size;
+  data->data = malloc(data->size * sizeof(char));
+  file_read(fp, (ptr & OFF_MASK) + sizeof(rec), data->data, data->size);
+
+  return data;
+}
+
+/*
+ * return the size of a value without reading it
+ */
+uint64_t log_size(uint64_t ptr) {
+  FILE* fp = open_seg(ptr >> OFF_BITS);
+  record_t rec;
+  file_read(fp, ptr & OFF_MASK, &rec, sizeof(rec));
+  return rec.size;
+}
+
+/*
+ * read `len` bytes from `pos` of a value
+ */
+void log_read_at(uint64_t ptr, uint64_t pos, char* buf, uint64_t len) {
+  FILE* fp = open_seg(ptr >> OFF_BITS);
+  file_read(fp, (ptr & OFF_MASK) + sizeof(record_t) + pos, buf, len);
+}
+
+/*
+ * mark a value dead, its space comes back when its segment is collected
+ */
+void log_free(uint64_t ptr) {
+  uint64_t seg = ptr >> OFF_BITS;
+  FILE* fp = open_seg(seg);
+  record_t rec;
+  file_read(fp, ptr & OFF_MASK, &rec, sizeof(rec));
+
+  assert(segs[seg - 1].live >= sizeof(rec) + rec.size);
+  int was_below = below(seg, cand_threshold);
+  segs[seg - 1].live -= sizeof(rec) + rec.size;
+  update_seg(seg);
+  if (!was_below) // live bytes only drop, so a segment is added once
+    consider(seg);
+}
+
+/*
+ * choose a sealed segment whose live bytes are below `threshold` percent
+ * return the one with the fewest live bytes, or NULL_SEG
+ *
+ * - only the candidates are looked at. all segments are scanned only
+ *   when the threshold changes.
+ */
+uint64_t log_victim(int threshold) {
+  if (threshold != cand_threshold) {
+    cand_threshold = threshold;
+    cand_count = 0;
+    for (uint64_t seg = 1; seg <= log_header.count; seg++)
+      consider(seg);
+  }
+  uint64_t victim = NULL_SEG;
+  for (uint64_t i = 0; i < cand_count; i++) {
+    seg_t* s = &segs[candidates[i] - 1];
+    if (victim == NULL_SEG || s->live * segs[victim - 1].total < segs[victim - 1].live * s->total)
+      victim = candidates[i];
+  }
+  return victim;
+}
+
+/*
+ * read the key and address of the record of `seg` at `*pos`,
+ * then move `*pos` to the next one
+ * return ERR at the end of the segment
+ */
+int log_scan(uint64_t seg, uint64_t* pos, uint64_t* key, uint64_t* ptr) {
+  if (*pos >= segs[seg - 1].total)
+    return ERR;
+  FILE* fp = open_seg(seg);
+  record_t rec;
+  file_read(fp, *pos, &rec, sizeof(rec));
+  *key = rec.key;
+  *ptr = (seg << OFF_BITS) | *pos;
+  *pos += sizeof(rec) + rec.size;
+  return OK;
+}
+
+/*
+ * delete a segment with no live value
+ * - the caller writes out pending writes first, see `file_sync()`.
+ */
+void log_drop(uint64_t seg) {
+  assert(seg != log_header.tail && segs[seg - 1].live == 0);
+  fflush(open_seg(log_header.tail)); // the moved values
+  fflush(man_fp);
+  if (seg_fp[seg - 1] != NULL) {
+    fclose(seg_fp[seg - 1]);
+    seg_fp[seg - 1] = NULL;
+  }
+  char buf[4096];
+  seg_name(buf, sizeof(buf), seg);
+  unlink(buf);
+  segs[seg - 1].total = 0;
+  update_seg(seg);
+
+  for (uint64_t i = 0; i < cand_count; i++) {
+    if (candidates[i] == seg) {
+      candidates[i] = candidates[--cand_count];
+      break;
+    }
+  }
+  free_segs[free_count++] = seg;
+}
+
+void log_destroy() {
+  update_log_header();
+  for (uint64_t i = 0; i < seg_cap; i++)
+    if (seg_fp[i] != NULL)
+      fclose(seg_fp[i]);
+  fclose(man_fp);
+  free(segs);
+  free(seg_fp);
+  free(free_segs);
+  free(candidates);
+  free(log_fn);
+  segs = NULL;
+  seg_fp = NULL;
+  free_segs = NULL;
+  candidates = NULL;
+  seg_cap = 0;
+  free_count = 0;
+  cand_count = 0;
+  cand_threshold = -1;
+}
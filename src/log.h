@@ -0,0 +1,31 @@
+/*
+ * log.h
+ */
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <stdint.h>
+
+#include "bptree.h"
+
+void log_init(const char* fn);
+
+uint64_t log_append(uint64_t key, const char* data, uint64_t size);
+
+data_t* log_read(uint64_t ptr);
+
+uint64_t log_size(uint64_t ptr);
+
+void log_read_at(uint64_t ptr, uint64_t pos, char* buf, uint64_t len);
+
+void log_free(uint64_t ptr);
+
+uint64_t log_victim(int threshold);
+
+int log_scan(uint64_t seg, uint64_t* pos, uint64_t* key, uint64_t* ptr);
+
+void log_drop(uint64_t seg);
+
+void log_destroy();
+
+#endif // _LOG_H_
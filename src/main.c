@@ -1,71 +1,301 @@
+/*
+ * main.c
+ *
+ * randomized test of bptree against an array of expected data.
+ *
+ * usage: main [mode] [ops]
+ * - mode: tree, eager, lazy, empty, cache, log, hash, batch
+ *   eager, lazy and empty run with that rebalance policy, erase most
+ *   keys after filling, call rebalance() periodically, and switch to the
+ *   next policy halfway.
+ *   cache turns on a small record cache, and reads every found key twice
+ *   so the second read hits the cache. half of its updates go through
+ *   write_value().
+ *   log keeps larger values in the log store with a high gc threshold,
+ *   so segments roll over, get collected and have their numbers reused.
+ *   it calls gc() periodically, and its second half runs in batches.
+ *   hash uses the hash index, whose directory outgrows its first page
+ *   while filling, and checks that it answers no order queries.
+ *   batch runs every BATCH_SIZE operations in one batch, so reads see
+ *   writes which are still in memory.
+ * - ops 0 runs forever, test/test.sh uses it to watch the files grow.
+ * - with bounded ops, every key is inserted first so the tree grows
+ *   to three levels, and every key is checked again after reopening.
+ */
 #include "bptree.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <glob.h>
 
-int ans[1000];
+#define CHECK_INTERVAL 1000
+#define REBALANCE_INTERVAL 5000
+#define MAX_DATA 2048
+#define CACHE_SIZE (64 << 10)
+#define GC_THRESHOLD 100
+#define BATCH_SIZE 100
 
-void init_test() {
-  for (int i = 0; i < 1000; i++) {
-    ans[i] = 0;
+int* ans; // version of data of each key, 0 if absent
+uint64_t keys = 30000;
+int max_pad = 192; // data of log mode is larger, so segments roll over often
+int cached;
+int logged;
+int hashed;
+int batched;
+
+void fail(const char* what, uint64_t num) {
+  fprintf(stderr, "%s fail: %lu\n", what, (unsigned long)num);
+  abort();
+}
+
+/*
+ * remove files of database `fn` left by an earlier run
+ */
+void cleanup(const char* fn) {
+  char pattern[256];
+  snprintf(pattern, sizeof(pattern), "%s.*", fn);
+  glob_t g;
+  if (glob(pattern, 0, NULL, &g) == 0) {
+    for (size_t i = 0; i < g.gl_pathc; i++)
+      remove(g.gl_pathv[i]);
+    globfree(&g);
+  }
+}
+
+/*
+ * data of `num` at `version`, its size varies with both
+ */
+int make_data(char* s, uint64_t num, int version) {
+  int len = sprintf(s, "data %lu %d ", (unsigned long)num, version);
+  int pad = (num * 7 + version * 13) % max_pad;
+  memset(s + len, 'a' + num % 26, pad);
+  s[len + pad] = '\0';
+  return len + pad + 1;
+}
+
+void check_find(uint64_t num) {
+  char s[MAX_DATA];
+  data_t* data = find(num);
+  if (ans[num] == 0) {
+    if (data->size != 0)
+      fail("find", num);
+  }
+  else {
+    uint64_t len = make_data(s, num, ans[num]);
+    if (data->size != len || memcmp(data->data, s, len) != 0)
+      fail("find", num);
   }
+  free(data->data);
+  free(data);
 }
 
-int func(char* s) { 
-  s[5] = (rand() % 10) ^ '0';
-  s[6] = (rand() % 10) ^ '0';
-  s[7] = (rand() % 10) ^ '0';
-  int num = s[5] ^ '0';
-  num *= 10;
-  num += (s[6] ^ '0');
-  num *= 10;
-  num += (s[7] ^ '0');
-  if (s[5] == '0') {
-    s[5] = s[6];
-    s[6] = s[7];
-    s[7] = '\0';
+/*
+ * check rank(), select_key() and count_range() on a sample of keys
+ */
+void check_order() {
+  uint64_t stride = keys / 64 + 1;
+  uint64_t less = 0;
+  uint64_t key;
+  if (hashed) { // keys have no order in a hash index
+    if (rank(keys) != 0 || count_range(0, keys) != 0 || select_key(0, &key))
+      fail("order", keys);
+    return;
   }
-  if (s[5] == '0') {
-    s[5] = s[6];
-    s[6] = '\0';
+  for (uint64_t num = 0; num < keys; num++) {
+    if (num % stride == 0 && rank(num) != less)
+      fail("rank", num);
+    if (ans[num]) {
+      if (less % stride == 0 && (!select_key(less, &key) || key != num))
+        fail("select", num);
+      less++;
+    }
   }
-  return num;
+  if (select_key(less, &key))
+    fail("select", less);
+  if (count_range(0, keys) != less)
+    fail("count", keys);
 }
 
-int main() {
-  init_test();
-  init("test");
-  char* s = strdup("data 000");
-  while (1) {
-    int num = func(s);
-    int len = strlen(s) + 1;
+/*
+ * write `num` through two streams opened on it, the first write moves
+ * the data into extents under the second stream
+ */
+void check_streams(uint64_t num) {
+  char s[MAX_DATA];
+  stream_t* a = open_value(num);
+  stream_t* b = open_value(num);
+  for (int k = 0; k < 2; k++) {
+    int len = make_data(s, num, ans[num] + 1);
+    stream_t* stream = k == 0 ? a : b;
+    if (write_value(stream, 0, s, len) != (uint64_t)len)
+      fail("write", num);
+    ans[num]++;
+  }
+  check_find(num);
+  if (create_value(num) != NULL)
+    fail("create", num);
+  close_value(a);
+  close_value(b);
+}
+
+void check_all() {
+  for (uint64_t num = 0; num < keys; num++)
+    check_find(num);
+  check_order();
+}
+
+/*
+ * init() must refuse an index file of another format
+ * - the file is damaged, so call it last.
+ */
+void check_format(const char* fn) {
+  char idx[256];
+  snprintf(idx, sizeof(idx), "%s.idx", fn);
+  FILE* fp = fopen(idx, "rb+");
+  uint64_t format = 0;
+  fwrite(&format, sizeof(format), 1, fp);
+  fclose(fp);
+  if (init(fn))
+    fail("format", 0);
+}
+
+int main(int argc, char** argv) {
+  const char* mode = argc > 1 ? argv[1] : "tree";
+  uint64_t ops = argc > 2 ? strtoull(argv[2], NULL, 10) : 0;
+  char fn[64];
+  snprintf(fn, sizeof(fn), "test_%s", mode);
+
+  int policy = -1;
+  if (strcmp(mode, "eager") == 0)
+    policy = REBALANCE_EAGER;
+  else if (strcmp(mode, "lazy") == 0)
+    policy = REBALANCE_LAZY;
+  else if (strcmp(mode, "empty") == 0)
+    policy = REBALANCE_EMPTY;
+  else if (strcmp(mode, "cache") == 0)
+    cached = 1;
+  else if (strcmp(mode, "log") == 0)
+    logged = 1;
+  else if (strcmp(mode, "hash") == 0)
+    hashed = 1;
+  else if (strcmp(mode, "batch") == 0)
+    batched = 1;
+  else if (strcmp(mode, "tree") != 0) {
+    fprintf(stderr, "unknown mode: %s\n", mode);
+    return 1;
+  }
+  if (policy >= 0)
+    set_rebalance(policy);
+  if (cached)
+    set_cache(CACHE_SIZE);
+  if (hashed)
+    set_index(INDEX_HASH);
+  if (logged) {
+    max_pad = MAX_DATA - 64;
+    set_store(STORE_LOG);
+    set_gc(GC_THRESHOLD);
+  }
+
+  ans = calloc(keys, sizeof(int));
+  cleanup(fn);
+  if (!init(fn))
+    fail("init", 0);
+  if (init(fn)) // locked by the first one
+    fail("lock", 0);
+
+  char s[MAX_DATA];
+  if (ops > 0) {
+    for (uint64_t num = 0; num < keys; num++) {
+      if (!insert(num, s, make_data(s, num, 1)))
+        fail("insert", num);
+      ans[num] = 1;
+    }
+    check_all();
+    if (cached)
+      check_streams(0);
+  }
+
+  if (ops > 0 && policy >= 0) { // drain, so nodes underflow under every policy
+    for (uint64_t num = keys; num-- > 0; ) { // backwards, so free_data() finds its place at once
+      if (rand() % 10 == 0)
+        continue;
+      if (!erase(num))
+        fail("erase", num);
+      ans[num] = 0;
+      if (num % REBALANCE_INTERVAL == REBALANCE_INTERVAL - 1)
+        rebalance();
+      if (num % CHECK_INTERVAL == 0)
+        check_order();
+    }
+    check_all();
+  }
+
+  for (uint64_t i = 0; ops == 0 || i < ops; i++) {
+    if (logged && ops > 0 && i == ops / 2)
+      batched = 1;
+    if (batched && i % BATCH_SIZE == 0)
+      begin_batch();
+    uint64_t num = rand() % keys;
     int r = rand();
-    if (r % 3 == 0) {
+    if (r % 4 == 0) {
+      int len = make_data(s, num, 1);
       int rv = insert(num, s, len);
-      printf("insert: %d, %d\n", num, rv);
-      if ((rv ^ ans[num]) == 0) {
-        printf("insert fail\n");
-        abort();
-      }
-      ans[num] = 1;
+      printf("insert: %lu, %d\n", (unsigned long)num, rv);
+      if (rv != (ans[num] == 0))
+        fail("insert", num);
+      if (rv)
+        ans[num] = 1;
     }
-    else if (r % 3 == 1) {
-      data_t* data = find(num);
-      printf("find: %d, %s\n", num, data->size > 0 ? data->data : "null");
-      if ((data->size ^ ans[num]) == 1) {
-        printf("find fail\n");
-        abort();
-      }
+    else if (r % 4 == 1) {
+      printf("find: %lu\n", (unsigned long)num);
+      check_find(num);
+      if (cached)
+        check_find(num);
+      if (!hashed && count_range(num, num + 1) != (ans[num] != 0))
+        fail("count", num);
     }
-    else {
+    else if (r % 4 == 2) {
       int rv = erase(num);
-      printf("erase: %d, %d\n", num, rv);
-      if ((rv ^ ans[num]) == 1) {
-        printf("erase fail\n");
-        abort();
-      }
+      printf("erase: %lu, %d\n", (unsigned long)num, rv);
+      if (rv != (ans[num] != 0))
+        fail("erase", num);
       ans[num] = 0;
     }
+    else {
+      int len = make_data(s, num, ans[num] + 1);
+      int rv;
+      stream_t* stream = cached && rand() % 2 ? open_value(num) : NULL;
+      if (stream != NULL && (uint64_t)len >= stream->size)
+        rv = write_value(stream, 0, s, len) == (uint64_t)len;
+      else
+        rv = update(num, s, len);
+      if (stream != NULL)
+        close_value(stream);
+      printf("update: %lu, %d\n", (unsigned long)num, rv);
+      if (rv != (ans[num] != 0))
+        fail("update", num);
+      if (rv)
+        ans[num]++;
+    }
+    if (policy >= 0 && i % REBALANCE_INTERVAL == REBALANCE_INTERVAL - 1)
+      rebalance();
+    if (logged && i % REBALANCE_INTERVAL == REBALANCE_INTERVAL - 1)
+      gc();
+    if (policy >= 0 && ops > 0 && i == ops / 2)
+      set_rebalance((policy + 1) % 3);
+    if (i % CHECK_INTERVAL == 0)
+      check_order();
+    if (batched && (i % BATCH_SIZE == BATCH_SIZE - 1 || i + 1 == ops))
+      end_batch();
   }
+
+  check_all();
+  destroy();
+  if (!init(fn))
+    fail("init", 0);
+  check_all();
+  destroy();
+  check_format(fn);
+  printf("ok\n");
   return 0;
 }
@@ -0,0 +1,99 @@
+/*
+ * net.c
+ *
+ * socket helpers shared by server and client.
+ * - an address made of digits is a port on 127.0.0.1,
+ *   anything else is the path of a unix domain socket.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "net.h"
+
+static int is_port(const char* addr) {
+  if (*addr == '\0')
+    return 0;
+  for (const char* p = addr; *p != '\0'; p++)
+    if (*p < '0' || *p > '9')
+      return 0;
+  return 1;
+}
+
+/*
+ * fill `sa` with `addr`
+ * return the length of the address, or 0 if `addr` is too long
+ */
+static socklen_t to_sockaddr(const char* addr, struct sockaddr_storage* sa) {
+  memset(sa, 0, sizeof(*sa));
+  if (is_port(addr)) {
+    struct sockaddr_in* in = (struct sockaddr_in*)sa;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(atoi(addr));
+    in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return sizeof(*in);
+  }
+  else {
+    struct sockaddr_un* un = (struct sockaddr_un*)sa;
+    if (strlen(addr) >= sizeof(un->sun_path))
+      return 0;
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, addr);
+    return sizeof(*un);
+  }
+}
+
+/*
+ * listen on `addr`, a stale unix domain socket is replaced
+ * return the socket, or -1 on error
+ */
+int net_listen(const char* addr) {
+  struct sockaddr_storage sa;
+  socklen_t len = to_sockaddr(addr, &sa);
+  if (len == 0)
+    return -1;
+
+  int fd = socket(sa.ss_family, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (sa.ss_family == AF_UNIX)
+    unlink(addr);
+  else {
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  }
+  if (bind(fd, (struct sockaddr*)&sa, len) < 0 || listen(fd, SOMAXCONN) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * connect to `addr`
+ * return the socket, or -1 on error
+ */
+int net_connect(const char* addr) {
+  struct sockaddr_storage sa;
+  socklen_t len = to_sockaddr(addr, &sa);
+  if (len == 0)
+    return -1;
+
+  int fd = socket(sa.ss_family, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr*)&sa, len) < 0) {
+    close(fd);
+    return -1;
+  }
+  if (sa.ss_family == AF_INET) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
@@ -0,0 +1,11 @@
+/*
+ * net.h
+ */
+#ifndef _NET_H_
+#define _NET_H_
+
+int net_listen(const char* addr);
+
+int net_connect(const char* addr);
+
+#endif // _NET_H_
@@ -0,0 +1,40 @@
+/*
+ * protocol.h
+ *
+ * binary protocol between server and client.
+ * - integers are in host byte order, both ends run on the same machine.
+ * - a client may send many requests before reading any response,
+ *   responses come back in the order of requests.
+ */
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include <stdint.h>
+
+#define OP_INSERT 0x01      // body: data
+#define OP_FIND 0x02        // response body: data
+#define OP_UPDATE 0x03      // body: data
+#define OP_ERASE 0x04
+#define OP_RANK 0x05        // response body: count
+#define OP_COUNT_RANGE 0x06 // key: left, body: right, response body: count
+#define OP_SELECT 0x07      // key: k, response body: key
+
+#define STATUS_ERR 0x00
+#define STATUS_OK 0x01
+
+#define MAX_BODY (64 << 20)
+
+typedef struct {
+  uint8_t op;
+  uint8_t reserved[3];
+  uint32_t size; // size of body
+  uint64_t key;
+} request_header;
+
+typedef struct {
+  uint8_t status;
+  uint8_t reserved[3];
+  uint32_t size; // size of body
+} response_header;
+
+#endif // _PROTOCOL_H_
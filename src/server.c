@@ -0,0 +1,335 @@
+/*
+ * server.c
+ *
+ * server owning one database, speaking the protocol in protocol.h.
+ * - one thread, one epoll loop, the database is never shared.
+ * - each turn of the loop drains every ready connection, runs all the
+ *   pipelined requests it got in one batch, so files are flushed once,
+ *   and answers them with one write.
+ * - a connection whose output piles up is not read until it drains,
+ *   and its unconsumed input is capped, so a peer which never reads
+ *   cannot grow the server.
+ *
+ * usage: server [db] [addr]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "bptree.h"
+#include "net.h"
+#include "protocol.h"
+
+#define MAX_EVENTS 64
+#define READ_SIZE (64 << 10)
+#define OUT_LIMIT (8 << 20) // stop running requests of a connection until its output drains
+#define IN_LIMIT (1 << 20)  // stop reading a connection, unless its next request is bigger
+
+typedef struct {
+  char* data;
+  uint64_t size;
+  uint64_t cap;
+  uint64_t pos; // consumed bytes
+} buffer_t;
+
+typedef struct {
+  int fd;
+  int eof;    // peer sent everything, close once answered
+  int closed; // broken, close now
+  int held;   // requests held back by OUT_LIMIT
+  uint32_t events;
+  buffer_t in;
+  buffer_t out;
+} conn_t;
+
+static volatile sig_atomic_t running = 1;
+static int ep;
+
+static void on_signal(int sig) {
+  (void)sig;
+  running = 0;
+}
+
+static void reserve(buffer_t* buf, uint64_t size) {
+  if (buf->size + size <= buf->cap)
+    return;
+  if (buf->pos > 0) { // compact
+    memmove(buf->data, buf->data + buf->pos, buf->size - buf->pos);
+    buf->size -= buf->pos;
+    buf->pos = 0;
+    if (buf->size + size <= buf->cap)
+      return;
+  }
+  uint64_t cap = buf->cap == 0 ? READ_SIZE : buf->cap;
+  while (cap < buf->size + size)
+    cap *= 2;
+  buf->data = realloc(buf->data, cap);
+  buf->cap = cap;
+}
+
+static void append(buffer_t* buf, const void* data, uint64_t size) {
+  reserve(buf, size);
+  memcpy(buf->data + buf->size, data, size);
+  buf->size += size;
+}
+
+static void watch(conn_t* conn, uint32_t events) {
+  if (conn->events == events)
+    return;
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = conn;
+  epoll_ctl(ep, EPOLL_CTL_MOD, conn->fd, &ev);
+  conn->events = events;
+}
+
+static void reply(conn_t* conn, int status, const void* body, uint32_t size) {
+  response_header res;
+  memset(&res, 0, sizeof(res));
+  res.status = status;
+  res.size = size;
+  append(&conn->out, &res, sizeof(res));
+  if (size > 0)
+    append(&conn->out, body, size);
+}
+
+/*
+ * run one request and queue its response
+ */
+static void handle(conn_t* conn, const request_header* req, const char* body) {
+  uint64_t num;
+  switch (req->op) {
+  case OP_INSERT:
+    reply(conn, insert(req->key, body, req->size), NULL, 0);
+    break;
+  case OP_FIND: {
+    data_t* data = find(req->key);
+    if (data->size > 0 && data->size <= MAX_BODY)
+      reply(conn, STATUS_OK, data->data, data->size);
+    else
+      reply(conn, STATUS_ERR, NULL, 0);
+    free(data->data);
+    free(data);
+    break;
+  }
+  case OP_UPDATE:
+    reply(conn, update(req->key, body, req->size), NULL, 0);
+    break;
+  case OP_ERASE:
+    reply(conn, erase(req->key), NULL, 0);
+    break;
+  case OP_RANK:
+    num = rank(req->key);
+    reply(conn, STATUS_OK, &num, sizeof(num));
+    break;
+  case OP_COUNT_RANGE:
+    if (req->size != sizeof(num)) {
+      reply(conn, STATUS_ERR, NULL, 0);
+      break;
+    }
+    memcpy(&num, body, sizeof(num));
+    num = count_range(req->key, num);
+    reply(conn, STATUS_OK, &num, sizeof(num));
+    break;
+  case OP_SELECT:
+    if (select_key(req->key, &num))
+      reply(conn, STATUS_OK, &num, sizeof(num));
+    else
+      reply(conn, STATUS_ERR, NULL, 0);
+    break;
+  default:
+    reply(conn, STATUS_ERR, NULL, 0);
+  }
+}
+
+/*
+ * run every complete request buffered in the connection
+ */
+static void handle_all(conn_t* conn) {
+  buffer_t* in = &conn->in;
+  conn->held = 0;
+  while (!conn->closed) {
+    request_header req;
+    if (in->size - in->pos < sizeof(req))
+      break;
+    if (conn->out.size - conn->out.pos >= OUT_LIMIT) {
+      conn->held = 1;
+      break;
+    }
+    memcpy(&req, in->data + in->pos, sizeof(req));
+    if (req.size > MAX_BODY) {
+      conn->closed = 1;
+      break;
+    }
+    if (in->size - in->pos < sizeof(req) + req.size)
+      break;
+    handle(conn, &req, in->data + in->pos + sizeof(req));
+    in->pos += sizeof(req) + req.size;
+  }
+  if (in->pos == in->size)
+    in->pos = in->size = 0;
+}
+
+/*
+ * read what the socket has, up to IN_LIMIT bytes of unconsumed input
+ * - the limit grows to fit the first pending request, so it can complete.
+ */
+static void read_all(conn_t* conn) {
+  buffer_t* in = &conn->in;
+  for (;;) {
+    uint64_t limit = IN_LIMIT;
+    request_header req;
+    if (in->size - in->pos >= sizeof(req)) {
+      memcpy(&req, in->data + in->pos, sizeof(req));
+      if (req.size <= MAX_BODY && sizeof(req) + req.size > limit)
+        limit = sizeof(req) + req.size;
+    }
+    if (in->size - in->pos >= limit)
+      return;
+    reserve(in, READ_SIZE);
+    uint64_t len = in->cap - in->size;
+    if (len > limit - (in->size - in->pos))
+      len = limit - (in->size - in->pos);
+    ssize_t n = read(conn->fd, in->data + in->size, len);
+    if (n > 0)
+      in->size += n;
+    else if (n < 0 && errno == EINTR)
+      continue;
+    else {
+      if (n == 0)
+        conn->eof = 1;
+      else if (errno != EAGAIN)
+        conn->closed = 1;
+      return;
+    }
+  }
+}
+
+/*
+ * write as much queued output as the socket takes
+ */
+static void write_all(conn_t* conn) {
+  buffer_t* out = &conn->out;
+  while (out->pos < out->size) {
+    ssize_t n = send(conn->fd, out->data + out->pos, out->size - out->pos, MSG_NOSIGNAL);
+    if (n > 0)
+      out->pos += n;
+    else if (n < 0 && errno == EINTR)
+      continue;
+    else {
+      if (errno != EAGAIN)
+        conn->closed = 1;
+      break;
+    }
+  }
+  if (out->pos == out->size)
+    out->pos = out->size = 0;
+  if (conn->eof && out->size == 0 && !conn->held)
+    conn->closed = 1;
+  if (!conn->closed)
+    watch(conn, (conn->eof || conn->held ? 0 : EPOLLIN) | (out->size > 0 ? EPOLLOUT : 0));
+}
+
+static void close_conn(conn_t* conn) {
+  epoll_ctl(ep, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  free(conn->in.data);
+  free(conn->out.data);
+  free(conn);
+}
+
+static void accept_all(int lfd) {
+  for (;;) {
+    int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+    if (fd < 0)
+      return;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // fails harmlessly on unix socket
+
+    conn_t* conn = calloc(1, sizeof(conn_t));
+    conn->fd = fd;
+    conn->events = EPOLLIN;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+  }
+}
+
+int main(int argc, char** argv) {
+  const char* db = argc > 1 ? argv[1] : "test";
+  const char* addr = argc > 2 ? argv[2] : "db.sock";
+
+  if (!init(db)) {
+    fprintf(stderr, "%s: cannot open database, it is in use or of another format\n", db);
+    return 1;
+  }
+  int lfd = net_listen(addr);
+  if (lfd < 0) {
+    perror(addr);
+    destroy();
+    return 1;
+  }
+  fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  ep = epoll_create1(0);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL; // listening socket
+  epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+
+  struct epoll_event events[MAX_EVENTS];
+  conn_t* ready[MAX_EVENTS];
+  while (running) {
+    int n = epoll_wait(ep, events, MAX_EVENTS, -1);
+    int nready = 0;
+    for (int i = 0; i < n; i++) {
+      conn_t* conn = events[i].data.ptr;
+      if (conn == NULL) {
+        accept_all(lfd);
+        continue;
+      }
+      if (!conn->held && events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        read_all(conn);
+      ready[nready++] = conn;
+    }
+    // run the requests of every ready connection, then answer them
+    begin_batch();
+    for (int i = 0; i < nready; i++)
+      handle_all(ready[i]);
+    end_batch();
+    for (int i = 0; i < nready; i++) {
+      conn_t* conn = ready[i];
+      if (!conn->closed)
+        write_all(conn);
+      while (!conn->closed && conn->held && conn->out.size == 0) {
+        begin_batch();
+        handle_all(conn);
+        end_batch();
+        write_all(conn);
+      }
+      if (conn->closed)
+        close_conn(conn);
+    }
+  }
+
+  close(lfd);
+  if (strspn(addr, "0123456789") != strlen(addr))
+    unlink(addr);
+  destroy();
+  return 0;
+}
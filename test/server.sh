@@ -0,0 +1,36 @@
+#!/bin/bash
+# Round trip through the server: start it on a fresh database, run the
+# load generator against it, then stop it. Run from the repository root.
+
+BIN_DIR="./bin"
+DB="test_server"
+SOCK="test_server.sock"
+TIMEOUT=60  # seconds, so a stuck pipeline fails instead of hanging
+
+cd $BIN_DIR || exit 1
+
+# Run bench with the given arguments against a new server
+run_bench() {
+    rm -f $DB.*
+    ./server $DB $SOCK &
+    SERVER_PID=$!
+    for i in $(seq 50); do
+        [ -S $SOCK ] && break
+        sleep 0.1
+    done
+
+    timeout $TIMEOUT ./bench $SOCK "$@"
+    bench_status=$?
+    kill $SERVER_PID
+    wait $SERVER_PID
+    server_status=$?
+
+    if [ $bench_status -ne 0 ] || [ $server_status -ne 0 ]; then
+        echo "bench $*: bench exited $bench_status, server exited $server_status" >&2
+        exit 1
+    fi
+}
+
+run_bench 20000 64 100 1000    # many small pipelined requests
+run_bench 200 64 2000000 50    # pipelined large values, past the server's output limit
+run_bench 2000 1 100 1000      # one request at a time
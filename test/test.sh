@@ -3,9 +3,9 @@
 BIN_DIR="./bin"
 LOG_INTERVAL=1  # Check every 1 second
 
-# Start main program with all output suppressed
+# Start main program with all output suppressed, arguments go to main
 cd $BIN_DIR
-"./main" > /dev/null &
+"./main" "$@" > /dev/null &
 MAIN_PID=$!
 cd ..
 